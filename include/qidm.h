@@ -1,19 +1,33 @@
 #ifndef IDM_H
 #define IDM_H
 
-#include <sys/queue.h>
 #include <stdlib.h>
 
 #define IDM_MISS ((unsigned) -1)
+#define IDS_SCAN 16 // ids, before we keep "at"
 
+/* A set of ids, kept as a contiguous stack. Once it
+ * holds more than IDS_SCAN, "at" maps each id back to its
+ * index in the stack, so that any of them can be taken
+ * out in O(1). Smaller ones are just scanned: "at" is as
+ * big as the largest id, which is a lot for a few ids
+ * that are far apart. Nothing is allocated per id, the
+ * arrays just double when they need to.
+ */
+
+/* An id, as ids_iter and ids_next go through them. It
+ * is just a view of the stack, so don't keep it around
+ * past the next change to the set.
+ */
 typedef struct ids_item {
 	unsigned value;
-	SLIST_ENTRY(ids_item) entry;
 } idsi_t;
 
-SLIST_HEAD(ids, ids_item);
-
-typedef struct ids ids_t;
+typedef struct ids {
+	unsigned *data;	// stack, with IDM_MISS on top
+	unsigned *at;	// id -> index in data
+	unsigned n, cap, at_cap;
+} ids_t;
 
 typedef struct {
 	ids_t free;
@@ -22,67 +36,134 @@ typedef struct {
 
 static inline
 ids_t ids_init(void) {
-	struct ids list;
-	SLIST_INIT(&list);
+	ids_t list;
+	list.data = NULL;
+	list.at = NULL;
+	list.n = list.cap = list.at_cap = 0;
 	return list;
 }
 
+static inline unsigned
+ids_at(ids_t *ids, unsigned id) {
+	unsigned i;
+
+	if (ids->at)
+		return id < ids->at_cap ? ids->at[id] : IDM_MISS;
+
+	for (i = 0; i < ids->n; i++)
+		if (ids->data[i] == id)
+			return i;
+
+	return IDM_MISS;
+}
+
+/* Make room in "at" for ids up to "id" */
+static inline void
+ids_at_grow(ids_t *list, unsigned id) {
+	unsigned i = list->at_cap;
+
+	list->at_cap = list->at_cap ? list->at_cap : 8;
+	while (list->at_cap <= id)
+		list->at_cap *= 2;
+
+	list->at = (unsigned *) realloc(list->at,
+			list->at_cap * sizeof(unsigned));
+
+	for (; i < list->at_cap; i++)
+		list->at[i] = IDM_MISS;
+}
+
+/* Start keeping "at", now that the set is big enough */
+static inline void
+ids_index(ids_t *list) {
+	unsigned i, max = 0;
+
+	for (i = 0; i < list->n; i++)
+		if (list->data[i] > max)
+			max = list->data[i];
+
+	ids_at_grow(list, max);
+	for (i = 0; i < list->n; i++)
+		list->at[list->data[i]] = i;
+}
+
 static inline void ids_free(ids_t *ids, unsigned id) {
-	idsi_t *item;
+	unsigned i = ids_at(ids, id), top;
+
+	if (i == IDM_MISS)
+		return;
+
+	top = ids->data[--ids->n];
+	ids->data[i] = top;
+	ids->data[ids->n] = IDM_MISS;
 
-	SLIST_FOREACH(item, ids, entry) {
-		if (item->value == id)
-			SLIST_REMOVE(ids, item,
-					ids_item, entry);
+	if (ids->at) {
+		ids->at[top] = i;
+		ids->at[id] = IDM_MISS;
 	}
 }
 
 static inline
 void ids_push(ids_t *list, unsigned id) {
-	idsi_t *item = (struct ids_item *)
-		malloc(sizeof(idsi_t));
-	item->value = id;
-	SLIST_INSERT_HEAD(list, item, entry);
+	if (ids_at(list, id) != IDM_MISS)
+		return;
+
+	if (list->n + 1 >= list->cap) {
+		list->cap = list->cap ? list->cap * 2 : 8;
+		list->data = (unsigned *) realloc(list->data,
+				list->cap * sizeof(unsigned));
+	}
+
+	list->data[list->n++] = id;
+	list->data[list->n] = IDM_MISS;
+
+	if (list->at) {
+		if (id >= list->at_cap)
+			ids_at_grow(list, id);
+		list->at[id] = list->n - 1;
+	} else if (list->n > IDS_SCAN)
+		ids_index(list);
 }
 
 static inline
 unsigned ids_pop(ids_t *list) {
-	idsi_t *popped = SLIST_FIRST(list);
 	unsigned ret;
 
-	if (!popped)
+	if (!list->n)
 		return (unsigned) IDM_MISS;
 
-	ret = popped->value;
-	SLIST_REMOVE_HEAD(list, entry);
-	free(popped);
+	ret = list->data[--list->n];
+	list->data[list->n] = IDM_MISS;
+	if (list->at)
+		list->at[ret] = IDM_MISS;
 	return ret;
 }
 
 static inline
 void ids_drop(ids_t *list) {
-	while (ids_pop(list) != IDM_MISS);
+	free(list->data);
+	free(list->at);
+	*list = ids_init();
 }
 
 static inline
 unsigned ids_peek(ids_t *list) {
-	idsi_t *top = SLIST_FIRST(list);
-	return top ? top->value : IDM_MISS;
+	return list->n ? list->data[list->n - 1] : IDM_MISS;
 }
 
 static inline
 idsi_t *ids_iter(ids_t *list) {
-	return SLIST_FIRST(list);
+	return (idsi_t *) list->data;
 }
 
 static inline int
 ids_next(unsigned *id, idsi_t **cur) {
 	idsi_t *prev = *cur;
-	if (!prev)
+	if (!prev || prev->value == IDM_MISS)
 		return 0;
 
 	*id = prev->value;
-	*cur = SLIST_NEXT(prev, entry);
+	*cur = prev + 1;
 	return 1;
 }
 
@@ -107,7 +188,7 @@ unsigned idm_push(idm_t *idm, unsigned n) {
 		ids_free(&idm->free, n);
 		return IDM_MISS;
 	}
-	
+
 	for (i = idm->last; i < n; i++)
 		ids_push(&idm->free, i);
 
@@ -138,16 +219,39 @@ unsigned idm_new(idm_t *idm) {
 	return ret;
 }
 
+/* Two ids in a row: the one returned, and the next */
+static inline
+unsigned idm_new_pair(idm_t *idm) {
+	unsigned ret = ids_pop(&idm->free);
+
+	if (ret != IDM_MISS) {
+		if (ids_at(&idm->free, ret + 1) != IDM_MISS) {
+			ids_free(&idm->free, ret + 1);
+			return ret;
+		}
+
+		if (ret + 1 == idm->last) {
+			idm->last++;
+			return ret;
+		}
+
+		ids_push(&idm->free, ret);
+	}
+
+	ret = idm->last;
+	idm->last += 2;
+	return ret;
+}
+
 #if 0
 #include <stdio.h>
 static inline void
 idm_debug(idm_t *idm) {
-	idsi_t *item;
 	unsigned i;
 
 	fprintf(stderr, "last %u free", idm->last);
-	SLIST_FOREACH(item, &idm->free, entry)
-		fprintf(stderr, " %u\n", item->value);
+	for (i = 0; i < idm->free.n; i++)
+		fprintf(stderr, " %u", idm->free.data[i]);
 
 	fprintf(stderr, "\n");
 }
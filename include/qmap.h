@@ -3,6 +3,11 @@
 
 #include <stddef.h>
 #include <stdlib.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
 
 #define QM_MISS ((unsigned) -1)
 
@@ -17,6 +22,59 @@ enum qmap_flags {
 	// QM_PGET: default to obtaining primary keys
 	// instead of values.
 	QM_PGET = 4,
+
+	// QM_GROW: double the table size when it gets
+	// 3/4 full, instead of failing. Rehashing is
+	// spread over the following puts and dels.
+	QM_GROW = 8,
+
+	// QM_ARENA: keep keys and values in per-map
+	// slabs instead of a malloc each. Their memory
+	// is reused, and released in bulk on drop/close.
+	QM_ARENA = 16,
+
+	// QM_CONCURRENT: split the map into shards, each
+	// with its own lock, so that several threads can
+	// put, get, del and iterate it at once. Needs
+	// keys; can't be used with QM_MIRROR, QM_AINDEX
+	// or qmap_assoc. Pointers that come back stay
+	// valid only until their key is put again or
+	// deleted.
+	QM_CONCURRENT = 32,
+
+	// QM_LOCKFREE: for maps that are read a lot more
+	// than written. Gets and iteration take no locks,
+	// so they scale with threads; writers take one
+	// and make readers retry. What writers take out is
+	// only freed once no reader can be looking at it,
+	// so readers that keep what they get, even just
+	// until they use it, wrap that in qmap_enter and
+	// qmap_leave. Can't have QM_CONCURRENT.
+	QM_LOCKFREE = 64,
+
+	// QM_SORTED: also keep keys in order (B+tree),
+	// so QM_RANGE iterations seek to the key and go
+	// on in key order, instead of scanning it all.
+	// Works for secondaries too. Don't change the
+	// map while going through it in order. Can't
+	// have QM_CONCURRENT or QM_LOCKFREE.
+	QM_SORTED = 128,
+
+	// QM_BORROW: keep the pointers given to put as
+	// they are, instead of copies. Contents are still
+	// what hashes and compares, but they are never
+	// copied or freed: they must outlive the entry.
+	// Can't have QM_AINDEX, QM_PTR keys or values,
+	// or a journal.
+	QM_BORROW = 256,
+
+	// QM_COUNTER: values are 64-bit counters (QM_U64),
+	// kept right in the table instead of a malloc
+	// each. See qmap_incr. Puts with a NULL value
+	// start them at 0. With QM_GROW, what
+	// qmap_get returns is only good until the next
+	// put, and there can't be secondaries.
+	QM_COUNTER = 512,
 };
 
 // built-in types
@@ -29,12 +87,26 @@ enum qmap_tbi {
 
 	// String contents hash and compare
 	QM_STR = 2,
+
+	// Interned strings (see qmap_intern). Maps keep
+	// a reference instead of a copy, compare them by
+	// pointer, and use the hash they came with. Keys
+	// given to them, including lookups, must be ones
+	// qmap_intern returned. Can't be saved, journaled
+	// or put in file maps.
+	QM_ISTR = 3,
+
+	// 64-bit unsigned integers, in host order. What
+	// values of QM_COUNTER maps are
+	QM_U64 = 4,
 };
 
 // iter flags
 enum qmap_if {
 	// Do a ranged iteration. Meaning. It will
 	// continue even if the key differs from the initial.
+	// With QM_SORTED, start at the first key that
+	// isn't before it, and go in key order.
 	QM_RANGE = 1,
 };
 
@@ -48,9 +120,12 @@ enum qmap_if {
  *
  * @param mask
  * 	Must be 2^n - 1. (mask + 1) is the table size.
+ * 	With QM_GROW, it is only the initial size.
  *
  * @param flags
- * 	0, QM_AINDEX, QM_MIRROR, or bitwise OR of both.
+ * 	0, or a bitwise OR of QM_AINDEX, QM_MIRROR,
+ * 	QM_GROW, QM_ARENA, QM_CONCURRENT, QM_LOCKFREE,
+ * 	QM_SORTED, QM_BORROW and QM_COUNTER.
  *
  * @returns
  * 	The map's handle for later reference.
@@ -70,6 +145,9 @@ void qmap_close(unsigned hd);
  * @param key	The key.
  *
  * @returns	A pointer to the value or NULL if not found.
+ * 		With QM_LOCKFREE, it is only safe to use
+ * 		between qmap_enter and qmap_leave calls
+ * 		made around the get.
  */
 const void *qmap_get(unsigned hd, const void * const key);
 
@@ -87,12 +165,117 @@ const void *qmap_get(unsigned hd, const void * const key);
  * 	secondary keys). May be NULL otherwise.
  *
  * @returns
- * 	The position your value should be stored at.
+ * 	The id the key ended up at, or the generated
+ * 	key itself, when the key was NULL (QM_AINDEX).
  */
 unsigned qmap_put(unsigned hd,
 		const void * const key,
 		const void * const value);
 
+/* Get many values at once. Keys are hashed and their
+ * table positions prefetched before any is resolved, so
+ * cache misses overlap instead of queuing up.
+ *
+ * @param hd	The handle.
+ * @param keys	The keys to look up.
+ * @param values
+ * 	Gets a pointer to each value, or NULL where the
+ * 	key was not found.
+ *
+ * @param num	How many keys there are.
+ *
+ * @returns	How many of them were found.
+ */
+unsigned qmap_get_many(unsigned hd,
+		const void * const *keys,
+		const void **values, unsigned num);
+
+/* Put many pairs at once. Like qmap_put, but keys are
+ * hashed and prefetched ahead, and secondaries are
+ * updated once per batch instead of once per pair.
+ *
+ * @param hd	The handle.
+ * @param keys	The keys. Entries may be NULL with QM_AINDEX.
+ * @param values	The values.
+ * @param ids
+ * 	May be NULL. Otherwise, it gets what qmap_put
+ * 	would have returned for each pair.
+ *
+ * @param num	How many pairs there are.
+ */
+void qmap_put_many(unsigned hd,
+		const void * const *keys,
+		const void * const *values,
+		unsigned *ids, unsigned num);
+
+/* Like qmap_get, but the value can be changed in place,
+ * within its length. Nothing else finds out: not the
+ * secondaries, which keep keys derived from the old
+ * value, nor a journal. Use qmap_upsert for those.
+ * Can't be used with QM_LOCKFREE, QM_PGET or QM_ISTR
+ * values.
+ *
+ * @param hd	The handle.
+ * @param key	The key.
+ *
+ * @returns	A pointer to the value or NULL if not found.
+ */
+void *qmap_get_mut(unsigned hd, const void * const key);
+
+/* Upsert callback type.
+ *
+ * @param value
+ * 	The value, to change in place. Zeroed if the key
+ * 	is new.
+ *
+ * @param found	Whether the key was there already.
+ * @param ctx	What was given to qmap_upsert.
+ */
+typedef void qmap_upsert_t(void *value, int found, void *ctx);
+
+/* Change the value of a key in place, or put it with a
+ * new one, letting cb fill it in. No copies are made of
+ * an existing entry, and secondaries are only updated
+ * if the key they derive from the value changed. Values
+ * need a fixed length (see qmap_reg); can't be used with
+ * QM_LOCKFREE or QM_BORROW.
+ *
+ * @param hd	The handle of a primary.
+ * @param key	The key.
+ * @param cb	Changes or fills in the value.
+ * @param ctx	Given to cb.
+ *
+ * @returns	A pointer to the value, like qmap_get.
+ */
+void *qmap_upsert(unsigned hd, const void * const key,
+		qmap_upsert_t *cb, void *ctx);
+
+/* Add to the counter of a key, starting it at 0 if the
+ * key isn't there. It's an upsert (see qmap_upsert), so
+ * secondaries and the journal hear about it. QM_LOCKFREE
+ * maps can't have secondaries for it: readers would see
+ * their counters go back while those are fixed.
+ *
+ * @param hd	The handle of a QM_COUNTER map.
+ * @param key	The key.
+ * @param delta	What to add. Negative ones subtract.
+ *
+ * @returns	The counter, after adding.
+ */
+uint64_t qmap_incr(unsigned hd, const void * const key,
+		int64_t delta);
+
+/* Like qmap_incr, but keys that are there already get
+ * an atomic add, with no lock and no copies, while other
+ * threads do the same or read. New keys are put under
+ * the writers' lock. The map must be QM_COUNTER and
+ * QM_LOCKFREE, without QM_GROW, secondaries or a
+ * journal, and keys must not be deleted meanwhile.
+ * Readers should load counters atomically.
+ */
+uint64_t qmap_incr_atomic(unsigned hd, const void * const key,
+		int64_t delta);
+
 /* Delete an item by key.
  *
  * @param hd	The handle.
@@ -100,6 +283,23 @@ unsigned qmap_put(unsigned hd,
  */
 void qmap_del(unsigned hd, const void * const key);
 
+/* Like qmap_put, qmap_get and qmap_del, but with the
+ * lengths the caller already knows, so keys and values
+ * of types that measure (see qmap_mreg) aren't measured
+ * again. They must be what qmap_len would have given:
+ * for QM_STR, that counts the terminating NUL. Either
+ * way, maps keep the lengths of what they store.
+ */
+unsigned qmap_putl(unsigned hd,
+		const void * const key, size_t klen,
+		const void * const value, size_t vlen);
+
+const void *qmap_getl(unsigned hd,
+		const void * const key, size_t klen);
+
+void qmap_dell(unsigned hd,
+		const void * const key, size_t klen);
+
 /* Drop all of them contents.
  *
  * @param hd
@@ -107,6 +307,94 @@ void qmap_del(unsigned hd, const void * const key);
  */
 void qmap_drop(unsigned hd);
 
+/* How many entries a map has. Doesn't look at them.
+ *
+ * @param hd
+ * 	The handle.
+ */
+unsigned qmap_count(unsigned hd);
+
+/* What qmap_stats reports. For QM_CONCURRENT maps, it is
+ * the sum of all shards.
+ */
+typedef struct qmap_stats {
+	unsigned count;		// live entries
+	unsigned capacity;	// positions
+	double load;		// count / capacity
+	unsigned probe_max;	// longest probe, in slots
+	double probe_mean;
+	size_t key_bytes;	// stored by this map
+	size_t value_bytes;
+	unsigned free_ids;	// waiting to be reused
+} qmap_stats_t;
+
+/* Look at how a map is doing: how full, how far keys
+ * are from their home slot, and how much memory keys
+ * and values take (secondaries don't store any). It
+ * visits every slot and entry, so don't call it often.
+ *
+ * @param hd
+ * 	The handle.
+ *
+ * @param stats
+ * 	Where to put them.
+ */
+void qmap_stats(unsigned hd, qmap_stats_t *stats);
+
+// what instrumented builds count (see qmap_instr)
+enum qmap_counter {
+	QM_C_LOOKUPS,	// probes of an index
+	QM_C_GROUPS,	// control byte groups they scanned
+	QM_C_CMPS,	// key compares they did
+	QM_C_ALLOCS,	// keys and values allocated
+	QM_C_FREES,	// and freed
+	QM_C_CURSORS,	// cursors taken by qmap_iter
+	QM_C_LINKS,	// puts and dels as a secondary
+	QM_COUNTERS,
+};
+
+// operations with a latency histogram
+enum qmap_op {
+	QM_OP_PUT,
+	QM_OP_GET,
+	QM_OP_DEL,
+	QM_OPS,
+};
+
+// bucket i counts ops that took [2^(i-1), 2^i) ns
+#define QM_HIST 32
+
+typedef struct qmap_instr {
+	unsigned long long counters[QM_COUNTERS];
+	unsigned long long hist[QM_OPS][QM_HIST];
+} qmap_instr_t;
+
+/* Read the counters and histograms of a map. They are
+ * only kept when the library is built with
+ * -DQM_INSTRUMENT; otherwise nothing is counted, and the
+ * hot paths are the same as without this.
+ *
+ * For QM_CONCURRENT maps, counters are the sum of all
+ * shards. Latencies are of the API calls on hd.
+ *
+ * @param hd
+ * 	The handle.
+ *
+ * @param instr
+ * 	Where to put them.
+ *
+ * @returns
+ * 	0, or -1 if the library wasn't built for it.
+ */
+int qmap_instr(unsigned hd, qmap_instr_t *instr);
+
+/* Set the counters and histograms of a map back to 0
+ *
+ * @param hd
+ * 	The handle.
+ */
+void qmap_instr_reset(unsigned hd);
+
 /* Association callback type
  *
  * @param skey
@@ -142,16 +430,37 @@ typedef void qmap_assoc_t(
 void qmap_assoc(unsigned hd,
 		unsigned link, qmap_assoc_t cb);
 
+/* The state of an iteration. Its fields are private;
+ * it's only here so cursors can live on the stack of
+ * the caller (see qmap_iter_init).
+ */
+typedef struct {
+	unsigned hd, pos, ipos, flags, shard;
+	const void *key;
+	void *node;
+} qmap_cur_t;
+
 /* Start iteration.
  *
  * @param key
  *  	NULL to start at the beginning; or a key to seek-start.
  *
  * @returns
- * 	A cursor handle.
+ * 	A cursor handle. Handles come from a pool of the
+ * 	calling thread, and only work in that thread.
  */
 unsigned qmap_iter(unsigned hd, const void * const key, unsigned flags);
 
+/* Start iteration with a cursor of our own. Same as
+ * qmap_iter, but nothing is allocated.
+ *
+ * @param cursor
+ * 	Where to keep the state. Stays in use until
+ * 	qmap_cnext returns 0, or qmap_cfin.
+ */
+void qmap_iter_init(qmap_cur_t *cursor, unsigned hd,
+		const void * const key, unsigned flags);
+
 /* Do iteration.
  *
  * @param key
@@ -169,14 +478,49 @@ unsigned qmap_iter(unsigned hd, const void * const key, unsigned flags);
 int qmap_next(const void **key, const void **value,
 		unsigned cur_id);
 
-/* Exit iteration early (optional).
- * Prevents cursor handle growth; otherwise no side effects.
+/* Exit iteration early. Gives the cursor handle back.
+ *
+ * Required on QM_LOCKFREE maps: the iteration stays in
+ * qmap_enter until it ends, so a cursor that is left
+ * unfinished keeps writers from freeing anything they
+ * take out, for good. Otherwise, it just prevents
+ * cursor handle growth.
  *
  * @param cur_id
  * 	Cursor handle.
  */
 void qmap_fin(unsigned cur_id);
 
+/* qmap_next, for cursors from qmap_iter_init */
+int qmap_cnext(const void **key, const void **value,
+		qmap_cur_t *cursor);
+
+/* qmap_fin, for cursors from qmap_iter_init. Required
+ * on QM_LOCKFREE maps, and not needed otherwise.
+ */
+void qmap_cfin(qmap_cur_t *cursor);
+
+/* Start reading QM_LOCKFREE maps from this thread.
+ *
+ * Values and keys we get in between are not freed
+ * until qmap_leave, even if a writer overwrites or
+ * deletes them meanwhile. qmap_get enters only for
+ * the lookup, so what it returns is unsafe to use past
+ * it unless we entered first:
+ *
+ *	qmap_enter();
+ *	value = qmap_get(hd, key);
+ *	... use value ...
+ *	qmap_leave();
+ *
+ * An iteration enters for its duration. It nests, and
+ * never blocks.
+ */
+void qmap_enter(void);
+
+/* Stop reading QM_LOCKFREE maps (see qmap_enter) */
+void qmap_leave(void);
+
 /* Measure callback type, to measure a key that
  * is of variable or dynamic size.
  *
@@ -203,6 +547,10 @@ typedef size_t qmap_measure_t(const void *data);
  */
 unsigned qmap_reg(size_t len);
 
+/* Compare callback type. 0 means equal. For QM_SORTED,
+ * it is positive when a goes before b, like the
+ * built-in ones (bytewise, and handles as numbers).
+ */
 typedef int qmap_cmp_t(
 		const void * const a,
 		const void * const b,
@@ -211,6 +559,57 @@ typedef int qmap_cmp_t(
 void
 qmap_cmp_set(unsigned ref, qmap_cmp_t *cmp);
 
+/* Hash callback type. All 64 bits are used: they are
+ * folded into the 32 the table keeps (see qmap_fold).
+ */
+typedef uint64_t qmap_hash_t(
+		const void * const key,
+		size_t len);
+
+/* Built-in hashes. XXH3 is the default for registered
+ * types and QM_PTR. QM_HNDL uses the handle itself, so
+ * that handles land where they are numbered; for ones
+ * that are strided or clustered, the integer mixer
+ * spreads them out (it takes keys of up to 8 bytes, and
+ * uses XXH3 past that). CRC32C uses the SSE4.2
+ * instruction where the build has it, a table otherwise.
+ */
+qmap_hash_t qmap_hash_xxh3, qmap_hash_mix, qmap_hash_ident,
+	    qmap_hash_crc32c;
+
+/* Change how keys of a type are hashed. Do it before
+ * opening maps with it, and the same way for any file
+ * (qmap_fopen) they are kept in.
+ *
+ * @param ref
+ * 	The type.
+ *
+ * @param hash
+ * 	A built-in one, or a function of our own.
+ */
+void qmap_hash_set(unsigned ref, qmap_hash_t *hash);
+
+/* The integer mixer (MurmurHash3's finalizer) */
+static inline uint64_t
+qmap_mix64(uint64_t h)
+{
+	h ^= h >> 33;
+	h *= 0xff51afd7ed558ccdull;
+	h ^= h >> 33;
+	h *= 0xc4ceb9fe1a85ec53ull;
+	h ^= h >> 33;
+	return h;
+}
+
+/* How a 64-bit hash becomes the 32-bit one in the table.
+ * Hashes that fit in 32 bits stay as they are.
+ */
+static inline unsigned
+qmap_fold(uint64_t h)
+{
+	return (unsigned) (h ^ (h >> 32));
+}
+
 /* Register a type of variable length for hashing
  * and comparing contents.
  *
@@ -222,6 +621,152 @@ qmap_cmp_set(unsigned ref, qmap_cmp_t *cmp);
  */
 unsigned qmap_mreg(qmap_measure_t *measure);
 
+/* Write a snapshot of a map to a file.
+ *
+ * It holds the bytes of each key and value, and what
+ * it takes to open the map again: types (and their
+ * lengths), size and flags. Entries of QM_AINDEX maps
+ * keep their positions, so keys that keyless puts gave
+ * out still find them. In native byte order, and
+ * with type ids as registered, so load it with the
+ * same build and the same qmap_reg / qmap_mreg calls.
+ *
+ * @param hd
+ * 	A primary. Secondaries of QM_MIRROR come back by
+ * 	themselves; others have to be associated again.
+ * 	Can't have QM_PTR keys or values.
+ *
+ * @param fd
+ * 	Where to write, from its current offset.
+ *
+ * @returns
+ * 	0 on success, -1 if a write failed (see errno).
+ */
+int qmap_save(unsigned hd, int fd);
+
+/* Open a map from a snapshot (see qmap_save).
+ *
+ * It is sized for all entries up front, and puts them
+ * in batches. Keys and values go into an arena
+ * (QM_ARENA), so there's no malloc per entry.
+ *
+ * @param fd
+ * 	Where to read, from its current offset to the end.
+ *
+ * @returns
+ * 	The map's handle, or QM_MISS if it isn't one.
+ */
+unsigned qmap_load(int fd);
+
+/* Open a map whose entries live in a file.
+ *
+ * The index, keys and values are all in the file, which
+ * is mapped, so opening an existing one only reads the
+ * header, which has the count and free positions as of
+ * the last close. One that wasn't closed (a crash) has
+ * its positions looked through instead. Keys and
+ * values are stored as offsets, and the file grows in
+ * place as more room is needed. Like snapshots, it is in
+ * native layout, so open it with the same build and the
+ * same qmap_reg / qmap_mreg calls. What qmap_get returns
+ * is valid until that entry changes or the map closes.
+ *
+ * @param path
+ * 	Created if it doesn't exist.
+ *
+ * @param mask
+ * 	As in qmap_open, for new files. These don't grow:
+ * 	size them for all entries up front. Ignored for
+ * 	existing files.
+ *
+ * @param flags
+ * 	Only QM_AINDEX. Can't have QM_PTR keys or values.
+ *
+ * @returns
+ * 	The map's handle, or QM_MISS if the file can't be
+ * 	opened or holds another kind of map.
+ */
+unsigned qmap_fopen(const char *path, unsigned ktype,
+		unsigned vtype, unsigned mask, unsigned flags);
+
+/* Keep a journal of the puts, deletes and drops of a map.
+ *
+ * Whatever the file already holds is applied to the map
+ * first, so open the last snapshot (qmap_load) and then
+ * this. A record cut short by a crash ends the journal,
+ * and is overwritten by the next one.
+ *
+ * Records are buffered, and written with a single fsync
+ * once "interval" ms went by since the last one, so a
+ * crash loses at most that much. A thread of the journal
+ * does it if no write comes along to, so that holds for
+ * idle maps as well. Close the map before the file.
+ *
+ * @param hd
+ * 	A primary, without QM_PTR keys or values.
+ *
+ * @param fd
+ * 	The journal, open for reading and writing.
+ *
+ * @param interval
+ * 	Milliseconds between syncs. 0 syncs every write.
+ *
+ * @returns
+ * 	0 on success, -1 on error (see errno), or if the
+ * 	file is the journal of another kind of map.
+ */
+int qmap_journal(unsigned hd, int fd, unsigned interval);
+
+/* Write and sync what the journal of a map has buffered.
+ *
+ * @returns
+ * 	0 on success, -1 if a write failed (see errno).
+ */
+int qmap_sync(unsigned hd);
+
+/* Save a snapshot of a journaled map, then empty its
+ * journal. Write it to a new file, and rename that over
+ * the last one once this returns: until then, the last
+ * snapshot and the journal are still whole.
+ *
+ * @param fd
+ * 	Where to write the snapshot (see qmap_save).
+ *
+ * @returns
+ * 	0 on success, -1 on error (see errno).
+ */
+int qmap_checkpoint(unsigned hd, int fd);
+
+/* Intern a string: get the process-wide copy of it,
+ * making one if there isn't any yet. Maps with QM_ISTR
+ * keys or values take their own reference to it, so
+ * callers can let go of theirs once it's put.
+ *
+ * @param str	The string.
+ *
+ * @returns
+ * 	The interned copy. Let go of it with qmap_unintern.
+ */
+const char *qmap_intern(const char *str);
+
+/* The interned copy of a string, if there is one. Good
+ * for lookups, which shouldn't intern what isn't there.
+ * Doesn't take a reference: the result is valid only
+ * while someone (a map, for one) holds one.
+ *
+ * @param str	The string.
+ *
+ * @returns	The interned copy, or NULL.
+ */
+const char *qmap_interned(const char *str);
+
+/* Let go of a string from qmap_intern. It is freed once
+ * no one holds it.
+ *
+ * @param str	The interned copy.
+ */
+void qmap_unintern(const char *str);
+
 /* Return the length of a certain element in memory.
  *
  * @param type_id
@@ -235,4 +780,73 @@ unsigned qmap_mreg(qmap_measure_t *measure);
  */
 size_t qmap_len(unsigned type_id, const void *data);
 
+/* What follows is for front ends that probe maps on
+ * their own (see qmap.hpp), and not otherwise needed.
+ */
+
+typedef struct {
+	unsigned n;	// position, or QM_MISS
+	unsigned hash;	// of the key, so we never redo it
+} qmap_slot_t;
+
+/* An id -> n map. Each id also has a control byte: 7
+ * bits mixed from its key's hash, or QM_EMPTY. Those are
+ * scanned a group at a time, Swiss table style, and
+ * copied past the end so that a group never needs to
+ * wrap around. Ids are kept Robin Hood style: a key is
+ * never further from its home (hash & mask) than the
+ * ones before it.
+ */
+typedef struct {
+	qmap_slot_t *slots;
+	unsigned char *ctrl;
+	unsigned mask;
+} qmap_idx_t;
+
+/* Which way ids are probed (see qmap_idx_t), for lookups
+ * inlined outside of the library, like qmap.hpp's. Those
+ * check it at compile time, so that a change to the
+ * probe, which has to bump it, can't leave them behind.
+ */
+#define QM_PROBE 1
+
+/* How far an id is from the home of its key */
+static inline unsigned
+qmap_slot_dist(const qmap_idx_t *idx, unsigned id)
+{
+	return (id - idx->slots[id].hash) & idx->mask;
+}
+
+/* How every map starts. Keys and values are pointers to
+ * their bytes (offsets, for file maps: base isn't NULL).
+ * Values are in the table of the primary (phd). While
+ * gmap has slots (QM_GROW), some ids are still there.
+ */
+typedef struct {
+	qmap_idx_t map;		// id -> n
+	const void **omap;	// n -> key
+	unsigned *ohash;	// n -> hash
+	void **table;		// n -> value
+	unsigned types[2];
+	unsigned m, flags, count;
+	unsigned phd;
+	qmap_idx_t gmap;
+	char *base;
+} qmap_head_t;
+
+/* The start of a map. Its address never changes while
+ * the map is open, but what it points to does, when the
+ * map changes. QM_CONCURRENT maps have no entries of
+ * their own, and QM_LOCKFREE ones have to be read as in
+ * qmap_get.
+ *
+ * @param hd
+ * 	The handle.
+ */
+const qmap_head_t *qmap_head(unsigned hd);
+
+#ifdef __cplusplus
+}
+#endif
+
 #endif
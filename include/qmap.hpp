@@ -0,0 +1,219 @@
+#ifndef QMAP_HPP
+#define QMAP_HPP
+
+#include "qmap.h"
+
+#include <cstring>
+#include <type_traits>
+
+/* A typed front end to qmap, for keys and values that
+ * are plain data (trivially copyable). Lookups probe the
+ * table right here, with hash and compare known at
+ * compile time, so they inline into the caller. Writes,
+ * and maps that have to be read with care (QM_LOCKFREE,
+ * QM_CONCURRENT, file maps, or ones that are growing),
+ * go through the C API, which can be used on hd() too.
+ *
+ *	qmap<unsigned, float> m;
+ *	m.put(3, 1.5f);
+ *	const float *v = m.get(3);
+ */
+
+/* How keys of type K are hashed and compared: by their
+ * bytes, so they shouldn't have padding. The map
+ * registers a type with qmap_reg that hashes the same
+ * way, so the C API agrees with what is inlined here.
+ * Specialize it for keys that need something else.
+ */
+template <typename K>
+struct qmap_traits {
+	static_assert(std::is_trivially_copyable<K>::value,
+			"qmap keys must be plain data");
+
+	static inline uint64_t
+	hash(const K &key)
+	{
+		const unsigned char *p = (const unsigned char *) &key;
+		uint64_t h = sizeof(K), w;
+		size_t i;
+
+		for (i = 0; i + sizeof(w) <= sizeof(K);
+				i += sizeof(w))
+		{
+			std::memcpy(&w, p + i, sizeof(w));
+			h = qmap_mix64(h ^ w);
+		}
+
+		if (i < sizeof(K)) {
+			w = 0;
+			std::memcpy(&w, p + i, sizeof(K) - i);
+			h = qmap_mix64(h ^ w);
+		}
+
+		return h;
+	}
+
+	static inline bool
+	equal(const K &a, const void *b)
+	{
+		return !std::memcmp(&a, b, sizeof(K));
+	}
+
+	// for the C API: the same hash, through a pointer
+	static uint64_t
+	chash(const void * const key, size_t len)
+	{
+		K k;
+
+		(void) len;
+		std::memcpy(&k, key, sizeof(K));
+		return hash(k);
+	}
+
+	static unsigned
+	type(void)
+	{
+		static const unsigned id = [] {
+			unsigned ret = qmap_reg(sizeof(K));
+
+			qmap_hash_set(ret, chash);
+			return ret;
+		}();
+
+		return id;
+	}
+};
+
+template <typename K, typename V>
+class qmap {
+	static_assert(std::is_trivially_copyable<V>::value,
+			"qmap values must be plain data");
+	static_assert(QM_PROBE == 1,
+			"get() probes differently than qmap_get");
+
+	unsigned hd_;
+	const qmap_head_t *head_;
+
+	static unsigned
+	vtype(void)
+	{
+		static const unsigned id = qmap_reg(sizeof(V));
+
+		return id;
+	}
+
+	// can we probe it here? otherwise, use qmap_get
+	inline bool
+	plain(void) const
+	{
+		return !(head_->flags & (QM_LOCKFREE
+					| QM_CONCURRENT))
+			&& !head_->gmap.slots && !head_->base;
+	}
+
+public:
+	/* Like qmap_open, but with the types of K and V.
+	 * flags can't have QM_MIRROR: secondaries have their
+	 * own types (open them with the C API and qmap_assoc).
+	 */
+	explicit qmap(unsigned mask = 0, unsigned flags = 0)
+		: hd_(qmap_open(qmap_traits<K>::type(), vtype(),
+					mask, flags & ~QM_MIRROR)),
+		  head_(qmap_head(hd_))
+	{}
+
+	~qmap()
+	{
+		qmap_close(hd_);
+	}
+
+	qmap(const qmap &) = delete;
+	qmap &operator=(const qmap &) = delete;
+
+	/* For the C API */
+	unsigned
+	hd(void) const
+	{
+		return hd_;
+	}
+
+	unsigned
+	size(void) const
+	{
+		return qmap_count(hd_);
+	}
+
+	/* Same as qmap_get, but NULL is also what you get on
+	 * a miss. The pointer is valid until key changes.
+	 */
+	inline const V *
+	get(const K &key) const
+	{
+		if (!plain())
+			return (const V *) qmap_get(hd_, &key);
+
+		const qmap_idx_t *idx = &head_->map;
+		unsigned hash = qmap_fold(qmap_traits<K>::hash(key));
+		unsigned mask = idx->mask, d;
+
+		for (d = 0; d <= mask; d++) {
+			const qmap_slot_t *slot
+				= &idx->slots[(hash + d) & mask];
+
+			// Robin Hood: ours would have been here
+			if (slot->n == QM_MISS || qmap_slot_dist(idx,
+						(hash + d) & mask) < d)
+				return NULL;
+
+			if (slot->hash == hash && slot->n < head_->m
+					&& head_->omap[slot->n]
+					&& qmap_traits<K>::equal(key,
+						head_->omap[slot->n]))
+				return (const V *) (head_->phd == hd_
+						? head_
+						: qmap_head(head_->phd))
+					->table[slot->n];
+		}
+
+		return NULL;
+	}
+
+	inline bool
+	contains(const K &key) const
+	{
+		return get(key);
+	}
+
+	unsigned
+	put(const K &key, const V &value)
+	{
+		return qmap_put(hd_, &key, &value);
+	}
+
+	void
+	del(const K &key)
+	{
+		qmap_del(hd_, &key);
+	}
+
+	void
+	drop(void)
+	{
+		qmap_drop(hd_);
+	}
+
+	/* Call f(key, value) for each entry */
+	template <typename F>
+	void
+	each(F f) const
+	{
+		const void *key, *value;
+		qmap_cur_t cur;
+
+		qmap_iter_init(&cur, hd_, NULL, 0);
+		while (qmap_cnext(&key, &value, &cur))
+			f(* (const K *) key, * (const V *) value);
+	}
+};
+
+#endif
@@ -0,0 +1,299 @@
+#include "./../include/qmap.h"
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+/* Throughput and latency of puts, gets, dels and
+ * iteration, for a few key types, key distributions and
+ * table sizes. Prints CSV on stdout, one line per run,
+ * so that two builds can be compared line by line.
+ *
+ * 	bench [max_log2]
+ *
+ * Sizes go from 2^10 entries (fits in L1) to 2^max_log2
+ * (22 by default, way past any LLC), 16x at a time.
+ * One op in SAMPLE is timed on its own for percentiles;
+ * throughput is over the whole run.
+ */
+
+#define SAMPLE 8
+#define MIN_LOG2 10
+#define STEP_LOG2 4
+#define STR_LEN 16
+
+enum dist {
+	SEQ,
+	UNIFORM,
+	ZIPF,
+	DISTS,
+};
+
+static const char *dist_names[] = {
+	"seq", "uniform", "zipf",
+};
+
+typedef struct {
+	uint64_t a, b;
+} pair_t;
+
+typedef struct {
+	const char *name;
+	unsigned type;
+	size_t size;
+} ktype_t;
+
+static ktype_t ktypes[] = {
+	{ "hndl", QM_HNDL, sizeof(unsigned) },
+	{ "str", QM_STR, STR_LEN },
+	{ "pair", 0, sizeof(pair_t) }, // registered in main
+};
+
+// what the current run is, for report
+static const char *r_ktype, *r_dist, *r_fanout;
+static unsigned r_n;
+
+static uint64_t *samples;
+static uint64_t rng = 0x9E3779B97F4A7C15ull;
+
+static inline uint64_t
+now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static inline uint64_t
+rnd(void)
+{
+	rng ^= rng << 13;
+	rng ^= rng >> 7;
+	rng ^= rng << 17;
+	return rng;
+}
+
+static int
+u64_cmp(const void *a, const void *b)
+{
+	uint64_t ua = * (uint64_t *) a, ub = * (uint64_t *) b;
+
+	return (ua > ub) - (ua < ub);
+}
+
+static void
+report(const char *op, unsigned count, uint64_t total,
+		unsigned ns)
+{
+	qsort(samples, ns, sizeof(uint64_t), u64_cmp);
+	printf("%s,%s,%u,%s,%s,%.3f,%llu,%llu,%llu\n",
+			r_ktype, r_dist, r_n, r_fanout, op,
+			total ? count * 1000.0 / total : 0.0,
+			(unsigned long long) samples[ns / 2],
+			(unsigned long long) samples[ns * 99 / 100],
+			(unsigned long long) samples[ns * 999 / 1000]);
+	fflush(stdout);
+}
+
+/* Run "body" count times, timing one in SAMPLE */
+#define RUN(op, count, ...) do { \
+	uint64_t t0 = now(), t; \
+	unsigned i, ns = 0; \
+	for (i = 0; i < (count); i++) { \
+		if (i % SAMPLE) { \
+			__VA_ARGS__; \
+			continue; \
+		} \
+		t = now(); \
+		__VA_ARGS__; \
+		samples[ns++] = now() - t; \
+	} \
+	report(op, count, now() - t0, ns); \
+} while (0)
+
+static char *
+keys_new(ktype_t *kt, unsigned n)
+{
+	char *keys = malloc(kt->size * n);
+	unsigned i;
+
+	for (i = 0; i < n; i++) {
+		char *key = keys + kt->size * i;
+
+		if (kt->type == QM_HNDL)
+			memcpy(key, &i, sizeof(i));
+		else if (kt->type == QM_STR)
+			snprintf(key, STR_LEN, "key-%u", i);
+		else {
+			pair_t pair = { i, i * 0x9E3779B97F4A7C15ull };
+			memcpy(key, &pair, sizeof(pair));
+		}
+	}
+
+	return keys;
+}
+
+static void
+shuffle(unsigned *ids, unsigned n)
+{
+	unsigned i, j, tmp;
+
+	for (i = n - 1; i > 0; i--) {
+		j = rnd() % (i + 1);
+		tmp = ids[i];
+		ids[i] = ids[j];
+		ids[j] = tmp;
+	}
+}
+
+/* Which keys to put and del (each once), and which to
+ * get. Zipf (s = 1) ranks go through "order", so that
+ * hot keys are spread over the table.
+ */
+static void
+streams(enum dist dist, unsigned n, unsigned *order,
+		unsigned *stream)
+{
+	double *cdf, h = 0;
+	unsigned i;
+
+	for (i = 0; i < n; i++)
+		order[i] = i;
+
+	if (dist != SEQ)
+		shuffle(order, n);
+
+	switch (dist) {
+	case SEQ:
+		for (i = 0; i < n; i++)
+			stream[i] = i;
+		break;
+	case UNIFORM:
+		for (i = 0; i < n; i++)
+			stream[i] = rnd() % n;
+		break;
+	default:
+		cdf = malloc(n * sizeof(double));
+		for (i = 0; i < n; i++)
+			cdf[i] = h += 1.0 / (i + 1);
+
+		for (i = 0; i < n; i++) {
+			double u = (rnd() >> 11) * 0x1p-53 * h;
+			unsigned lo = 0, hi = n - 1;
+
+			while (lo < hi) {
+				unsigned mid = (lo + hi) / 2;
+
+				if (cdf[mid] < u)
+					lo = mid + 1;
+				else
+					hi = mid;
+			}
+
+			stream[i] = order[lo];
+		}
+
+		free(cdf);
+	}
+}
+
+/* Room for n entries, without growing */
+static unsigned
+mask_for(unsigned n)
+{
+	unsigned mask = 0xF;
+
+	while (n > (mask + 1u) - ((mask + 1u) >> 2))
+		mask = (mask << 1) | 1;
+
+	return mask;
+}
+
+static void
+run(ktype_t *kt, enum dist dist, unsigned n,
+		unsigned fanout, int mirror)
+{
+	unsigned *order = malloc(n * sizeof(unsigned));
+	unsigned *stream = malloc(n * sizeof(unsigned));
+	unsigned *values = malloc(n * sizeof(unsigned));
+	unsigned mask = mask_for(n), hd, cur, j, count = 0;
+	unsigned ahds[4];
+	char *keys = keys_new(kt, n), fname[16];
+	const void *key, *value;
+
+	streams(dist, n, order, stream);
+	for (j = 0; j < n; j++)
+		values[j] = j;
+
+	hd = qmap_open(kt->type, QM_HNDL, mask,
+			mirror ? QM_MIRROR : 0);
+
+	for (j = 0; j < fanout; j++) {
+		ahds[j] = qmap_open(QM_HNDL, QM_HNDL, mask, 0);
+		qmap_assoc(ahds[j], hd, NULL);
+	}
+
+	if (mirror)
+		r_fanout = "mirror";
+	else {
+		snprintf(fname, sizeof(fname), "assoc%u", fanout);
+		r_fanout = fname;
+	}
+
+	r_ktype = kt->name;
+	r_dist = dist_names[dist];
+	r_n = n;
+
+	RUN("put", n, qmap_put(hd, keys + kt->size * order[i],
+				&values[order[i]]));
+	RUN("get", n, qmap_get(hd, keys + kt->size * stream[i]));
+
+	cur = qmap_iter(hd, NULL, 0);
+	RUN("iter", n, count += qmap_next(&key, &value, cur));
+	qmap_fin(cur);
+
+	RUN("del", n, qmap_del(hd, keys + kt->size * order[i]));
+
+	if (count != n)
+		fprintf(stderr, "iterated %u of %u\n", count, n);
+
+	for (j = 0; j < fanout; j++)
+		qmap_close(ahds[j]);
+
+	qmap_close(hd);
+	free(keys);
+	free(values);
+	free(stream);
+	free(order);
+}
+
+int
+main(int argc, char *argv[])
+{
+	unsigned max_log2 = argc > 1 ? atoi(argv[1]) : 22;
+	unsigned log2, k, d;
+
+	ktypes[2].type = qmap_reg(sizeof(pair_t));
+	samples = malloc(((1u << max_log2) / SAMPLE + 1)
+			* sizeof(uint64_t));
+
+	printf("ktype,dist,n,fanout,op,mops,p50_ns,p99_ns,p999_ns\n");
+
+	for (log2 = MIN_LOG2; log2 <= max_log2; log2 += STEP_LOG2)
+		for (k = 0; k < sizeof(ktypes) / sizeof(ktype_t); k++)
+			for (d = 0; d < DISTS; d++)
+				run(&ktypes[k], d, 1u << log2, 0, 0);
+
+	// what secondaries cost puts and dels
+	for (log2 = MIN_LOG2; log2 <= max_log2; log2 += STEP_LOG2) {
+		run(&ktypes[0], UNIFORM, 1u << log2, 0, 1);
+		run(&ktypes[0], UNIFORM, 1u << log2, 1, 0);
+		run(&ktypes[0], UNIFORM, 1u << log2, 4, 0);
+	}
+
+	free(samples);
+	return 0;
+}
@@ -11,15 +11,79 @@
 #include <stdlib.h>
 #include <string.h>
 #include <sys/queue.h>
+#include <sys/mman.h>
 #include <xxhash.h>
 #include <qsys.h>
 #include <limits.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <time.h>
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#if defined(__SSE4_2__)
+#include <nmmintrin.h>
+#endif
 
 /* MACROS, STRUCTS, ENUMS AND GLOBALS {{{ */
 
 #define QM_SEED 13
 #define QM_DEFAULT_MASK 0xFF
-#define QM_MAX 1024
+#define QM_CHUNK_BITS 16 // maps per reservation, see qmaps
+#define QM_CHUNK (1u << QM_CHUNK_BITS)
+#define QM_CHUNKS (1u << (32 - QM_CHUNK_BITS))
+#define QM_GROW_STEP 16
+#define QM_BATCH 16
+#define QM_SHARD_BITS 4
+#define QM_SHARDS (1u << QM_SHARD_BITS)
+#define QM_READERS 128 // with slots of their own
+#define QM_LINE 64
+#define QM_BT_ORDER 32
+#define QM_SNAP_MAGIC "QMAP"
+#define QM_SNAP_VERSION 2 // 2: positions
+#define QM_SNAP_BUF (64 * 1024)
+#define QM_FILE_MAX (1ull << 36) // reserved per file map
+#define QM_FILE_ALIGN (64 * 1024)
+#define QM_FILE_MIN 4 // 16 byte chunks
+#define QM_FILE_CLASSES 28
+#define QM_FILE_ARRAYS 5
+#define QM_FILE_MAGIC "QMFL"
+#define QM_FILE_VERSION 4 // 4: ids kept in the header
+#define QM_JOURNAL_MAGIC "QWAL"
+#define QM_JOURNAL_VERSION 2 // 2: positions
+#define QM_JOURNAL_NONE UINT32_MAX
+#define QM_POOL_MIN 64
+#define QM_UPSERT_BUF 64 // on the stack, before malloc
+
+// cursor flag, past the ones in qmap_if
+#define QM_CUR_END (1u << 31)
+#define QM_CUR_HELD (1u << 30) // the shard locks, see qmap_snext
+
+#define QM_ARENA_MIN 3 // 8 byte chunks
+#define QM_ARENA_MAX 11 // 2 KiB chunks
+#define QM_ARENA_BLOCK (64 * 1024)
+#define QM_ARENA_HDR 16
+
+#if defined(__AVX2__)
+#define QM_GROUP 32
+#else
+#define QM_GROUP 16
+#endif
+
+#define QM_EMPTY 0x80
+// 7 bits of the hash times the golden ratio: they depend
+// on all of it, not only on what is past the index bits
+// (nothing, from 2^25 ids on), and identity hashes of
+// consecutive keys (QM_HNDL) get different ones
+#define QM_H7(hash) ((unsigned char) \
+		(((unsigned) (hash) * 0x9E3779B1u) >> 25))
 
 #define TYPES_MASK 0xFF
 
@@ -28,6 +92,21 @@
 #define DEBUG(lvl, ...) \
 	if (DEBUG_LVL > lvl) WARN(__VA_ARGS__)
 
+/* Counters and latencies (see qmap_instr), only with
+ * -DQM_INSTRUMENT. Otherwise these are no-ops.
+ */
+#ifdef QM_INSTRUMENT
+#define QM_COUNT(qmap, c, num) \
+	__atomic_fetch_add(&(qmap)->instr.counters[c], \
+			num, __ATOMIC_RELAXED)
+#define QM_TSTART(t) uint64_t t = qmap_ns()
+#define QM_TEND(qmap, op, t) qmap_hist(qmap, op, t)
+#else
+#define QM_COUNT(qmap, c, num) do {} while (0)
+#define QM_TSTART(t) do {} while (0)
+#define QM_TEND(qmap, op, t) do {} while (0)
+#endif
+
 #define VAL_ADDR(qmap, n) \
 	(void **)(((char *) qmap->table) \
 			+ sizeof(void *) * n)
@@ -37,31 +116,154 @@ static_assert(QM_MISS == UINT_MAX, "assume UINT_MAX");
 enum QM_MBR {
 	QM_KEY,
 	QM_VALUE,
+	QM_RAW, // not a member, just malloced
 };
 
+typedef struct qmap_big {
+	LIST_ENTRY(qmap_big) entry;
+} qmap_big_t;
+
+/* Storage for keys and values (QM_ARENA). Power-of-two
+ * chunks are bumped out of big blocks and recycled through
+ * per-size free lists. Larger ones are malloced, but still
+ * listed so that they can be released in bulk.
+ */
+typedef struct {
+	void *free[QM_ARENA_MAX - QM_ARENA_MIN + 1];
+	char *pos, *end;
+	void *blocks;
+	LIST_HEAD(, qmap_big) big;
+} qmap_arena_t;
+
+/* Something a QM_LOCKFREE writer took out, which readers
+ * might still be looking at. Freed once they all moved
+ * past the epoch it was retired in.
+ */
+typedef struct {
+	const void *ptr;
+	unsigned long epoch;
+	enum QM_MBR mbr;
+	size_t len;
+} qmap_retired_t;
+
+/* An interned string (QM_ISTR). Maps and callers get
+ * str, and the rest is right before it.
+ */
+typedef struct {
+	uint64_t hash;
+	unsigned refs, n;
+	unsigned len; // counting the NUL
+	char str[];
+} qmap_istr_t;
+
+/* A thread that reads QM_LOCKFREE maps. Each one gets its
+ * own cache line, so that entering and leaving doesn't
+ * bounce lines between cores.
+ */
+typedef struct {
+	unsigned long epoch; // 0 when not reading
+	char pad[QM_LINE - sizeof(unsigned long)];
+} qmap_reader_t;
+
+/* How the file of a map (qmap_fopen) starts. Then come
+ * the slots, keys, values, hashes and control bytes, all
+ * sized for m. Keys and values are offsets into the file,
+ * and the chunks they point to come after those.
+ */
+typedef struct {
+	char magic[4];
+	uint32_t version;
+	uint32_t types[2], lens[2];
+	uint32_t m, group;
+	uint32_t count, last;	// as of the last close
+	uint32_t nfree, ffree;	// see qmap_fsave
+	uint32_t clean, pad;	// 0 while it is open
+	uint64_t end, cap;
+	uint64_t free[QM_FILE_CLASSES];
+} qmap_fhdr_t;
+
+/* A node of the ordered index (QM_SORTED), a B+tree of
+ * positions. Leaves are chained in key order. Inner ones
+ * keep the first position under each child, so there are
+ * no separator keys of their own to go stale.
+ */
+typedef struct qmap_bt {
+	unsigned n, leaf;
+	struct qmap_bt *prev, *next; // leaves only
+	unsigned pos[QM_BT_ORDER];
+	struct qmap_bt *kids[]; // inner nodes only
+} qmap_bt_t;
+
+/* One of the independently locked maps of QM_CONCURRENT */
+typedef struct {
+	pthread_mutex_t lock;
+	unsigned hd;
+} qmap_shard_t;
+
+/* A map. It starts like qmap_head_t, see qmap_head */
 typedef struct {
 	// these have to do with keys
-	unsigned *map;  	// id -> n
+	qmap_idx_t map;  	// id -> n
 	const void **omap;	// n -> key
+	unsigned *ohash;	// n -> hash
 
 	void **table;
 	unsigned types[2];
-	unsigned m, mask, flags;
+	unsigned m, flags, count;
+	unsigned phd;
+
+	// while growing (QM_GROW): the previous
+	// id -> n map, still being moved into map
+	qmap_idx_t gmap;
+
+	// file maps (qmap_fopen), base is NULL otherwise
+	char *base;
+	qmap_fhdr_t *fhdr;
+	int fd;
+
 	idm_t idm;
 	ids_t linked;
-
-	unsigned phd;
 	qmap_assoc_t *assoc;
-} qmap_t;
+	unsigned gpos;
 
-typedef struct {
-	unsigned hd, pos, sub_cur, ipos, flags;
-	const void * key;
-} qmap_cur_t;
+	qmap_arena_t *arena;
+	qmap_shard_t *shards;
+	qmap_bt_t *bt;
+
+	// n -> length of the key and of the value, for
+	// types that measure (qmap_mreg); NULL otherwise
+	unsigned *lens[2];
+
+	struct qmap_wal *wal; // see qmap_journal
 
-typedef unsigned qmap_hash_t(
-		const void * const key,
-		size_t len);
+#ifdef QM_INSTRUMENT
+	qmap_instr_t instr;
+#endif
+
+	// QM_LOCKFREE: writers lock and bump seq around
+	// changes, readers retry if it moved
+	pthread_mutex_t wlock;
+	unsigned seq;
+	qmap_retired_t *retired;
+	unsigned retired_n, retired_cap;
+} qmap_t;
+
+#define QM_HEAD_AT(field) \
+	static_assert(offsetof(qmap_t, field) \
+			== offsetof(qmap_head_t, field), \
+			"qmap_t must start like qmap_head_t")
+
+QM_HEAD_AT(map);
+QM_HEAD_AT(omap);
+QM_HEAD_AT(ohash);
+QM_HEAD_AT(table);
+QM_HEAD_AT(types);
+QM_HEAD_AT(m);
+QM_HEAD_AT(flags);
+QM_HEAD_AT(count);
+QM_HEAD_AT(phd);
+QM_HEAD_AT(gmap);
+QM_HEAD_AT(base);
 
 typedef struct {
 	size_t len;
@@ -70,28 +272,126 @@ typedef struct {
 	qmap_cmp_t *cmp;
 } qmap_type_t;
 
-static qmap_t qmaps[QM_MAX];
-static qmap_cur_t qmap_cursors[QM_MAX];
-static idm_t idm, cursor_idm;
+/* The handle table, in chunks of QM_CHUNK maps. Each is
+ * reserved when handles first reach it, and memory only
+ * gets used as they go through it. So it grows with no
+ * copies, a map never moves, and there's no limit but
+ * that of handles themselves.
+ */
+static qmap_t *qmaps[QM_CHUNKS];
+static idm_t idm;
+
+static inline qmap_t *
+qmap_at(unsigned hd)
+{
+	return &qmaps[hd >> QM_CHUNK_BITS][hd & (QM_CHUNK - 1)];
+}
+
+// cursor handles are per thread, see qmap_iter
+static __thread qmap_cur_t *qmap_cursors;
+static __thread unsigned cursors_cap;
+static __thread idm_t cursor_idm;
+static pthread_key_t cursor_key;
+
+// handles, types and readers
+static pthread_mutex_t qmap_lock = PTHREAD_MUTEX_INITIALIZER;
 
 static qmap_type_t qmap_types[TYPES_MASK + 1];
 static unsigned types_n = 0;
 
+// epoch based reclamation (QM_LOCKFREE)
+static qmap_reader_t qmap_readers[QM_READERS + 1];
+static unsigned long qmap_epoch = 1;
+static unsigned qmap_nreaders = 0;
+static unsigned qmap_rshared = 0; // in the last slot
+static idm_t reader_idm;
+static pthread_key_t reader_key;
+static __thread unsigned qmap_rid = QM_MISS, qmap_rnest = 0;
+
+/* The strings of QM_ISTR, each kept once for the whole
+ * process. They have positions, like map entries, and
+ * are found through an id -> n index of their own.
+ */
+static struct {
+	pthread_mutex_t lock;
+	qmap_idx_t idx;
+	qmap_istr_t **entries;
+	idm_t idm;
+	unsigned count;
+} qmap_pool = { .lock = PTHREAD_MUTEX_INITIALIZER };
+
 /* }}} */
 
 /* BUILT-INS {{{ */
 
-static unsigned
-qmap_nohash(const void * const key, size_t len UNUSED)
+uint64_t /* API */
+qmap_hash_xxh3(const void * const key, size_t len)
+{
+	return XXH3_64bits_withSeed(key, len, QM_SEED);
+}
+
+uint64_t /* API */
+qmap_hash_ident(const void * const key, size_t len)
 {
-	unsigned u;
-	memcpy(&u, key, sizeof(u));
+	uint64_t u = 0;
+
+	memcpy(&u, key, len < sizeof(u) ? len : sizeof(u));
 	return u;
 }
 
-static unsigned
-qmap_chash(const void *data, size_t len) {
-	return XXH32(data, len, QM_SEED);
+uint64_t /* API */
+qmap_hash_mix(const void * const key, size_t len)
+{
+	uint64_t u = 0;
+
+	if (len > sizeof(u))
+		return qmap_hash_xxh3(key, len);
+
+	memcpy(&u, key, len);
+	return qmap_mix64(u ^ len);
+}
+
+#if !defined(__SSE4_2__)
+static uint32_t crc32c_table[256];
+
+static void
+qmap_crc32c_init(void)
+{
+	uint32_t i, j, c;
+
+	for (i = 0; i < 256; i++) {
+		for (c = i, j = 0; j < 8; j++)
+			c = (c >> 1) ^ (0x82F63B78u & -(c & 1));
+		crc32c_table[i] = c;
+	}
+}
+#endif
+
+uint64_t /* API */
+qmap_hash_crc32c(const void * const key, size_t len)
+{
+	const unsigned char *p = key;
+	uint32_t crc = ~0u;
+
+#if defined(__SSE4_2__)
+	uint64_t crc64 = crc, w;
+
+	for (; len >= sizeof(w); len -= sizeof(w),
+			p += sizeof(w))
+	{
+		memcpy(&w, p, sizeof(w));
+		crc64 = _mm_crc32_u64(crc64, w);
+	}
+
+	crc = crc64;
+	for (; len; len--)
+		crc = _mm_crc32_u8(crc, *p++);
+#else
+	for (; len; len--)
+		crc = (crc >> 8) ^ crc32c_table[(crc ^ *p++) & 0xFF];
+#endif
+
+	return ~crc;
 }
 
 static int
@@ -102,6 +402,32 @@ qmap_ccmp(const void * const a,
 	return memcmp((char *) b, (char *) a, len);
 }
 
+/* Handles compare as numbers, so they sort that way */
+static int
+qmap_ucmp(const void * const a,
+		const void * const b,
+		size_t len UNUSED)
+{
+	unsigned ua, ub;
+
+	memcpy(&ua, a, sizeof(ua));
+	memcpy(&ub, b, sizeof(ub));
+	return (ub > ua) - (ub < ua);
+}
+
+/* 64-bit integers compare as numbers too */
+static int
+qmap_u64cmp(const void * const a,
+		const void * const b,
+		size_t len UNUSED)
+{
+	uint64_t ua, ub;
+
+	memcpy(&ua, a, sizeof(ua));
+	memcpy(&ub, b, sizeof(ub));
+	return (ub > ua) - (ub < ua);
+}
+
 static void
 qmap_rassoc(const void **skey,
 		const void * const pkey UNUSED,
@@ -112,508 +438,4097 @@ qmap_rassoc(const void **skey,
 
 /* }}} */
 
+/* ARENA {{{ */
+
+static inline unsigned
+qmap_arena_shift(size_t len)
+{
+	if (len <= (1u << QM_ARENA_MIN))
+		return QM_ARENA_MIN;
+
+	return 32 - __builtin_clz((unsigned) len - 1);
+}
+
+static void *
+qmap_arena_alloc(qmap_arena_t *arena, size_t len)
+{
+	unsigned shift;
+	size_t size, align;
+	void **head;
+	char *ret;
+
+	if (len > (1u << QM_ARENA_MAX)) {
+		qmap_big_t *big = malloc(QM_ARENA_HDR + len);
+
+		CBUG(!big, "malloc error\n");
+		LIST_INSERT_HEAD(&arena->big, big, entry);
+		return (char *) big + QM_ARENA_HDR;
+	}
+
+	shift = qmap_arena_shift(len);
+	head = &arena->free[shift - QM_ARENA_MIN];
+
+	if (*head) {
+		ret = *head;
+		*head = * (void **) ret;
+		return ret;
+	}
+
+	size = (size_t) 1 << shift;
+	align = size < 16 ? size : 16;
+	ret = (char *) (((uintptr_t) arena->pos + align - 1)
+			& ~(uintptr_t) (align - 1));
+
+	if (!arena->pos || ret + size > arena->end) {
+		char *block = malloc(QM_ARENA_BLOCK);
+
+		CBUG(!block, "malloc error\n");
+		* (void **) block = arena->blocks;
+		arena->blocks = block;
+		arena->end = block + QM_ARENA_BLOCK;
+		ret = block + QM_ARENA_HDR;
+	}
+
+	arena->pos = ret + size;
+	return ret;
+}
+
+static void
+qmap_arena_free(qmap_arena_t *arena, void *ptr, size_t len)
+{
+	void **head;
+
+	if (len > (1u << QM_ARENA_MAX)) {
+		qmap_big_t *big = (qmap_big_t *)
+			((char *) ptr - QM_ARENA_HDR);
+
+		LIST_REMOVE(big, entry);
+		free(big);
+		return;
+	}
+
+	head = &arena->free[qmap_arena_shift(len) - QM_ARENA_MIN];
+	* (void **) ptr = *head;
+	*head = ptr;
+}
+
+/* Give everything back at once */
+static void
+qmap_arena_drop(qmap_arena_t *arena)
+{
+	qmap_big_t *big;
+	void *block;
+
+	while ((block = arena->blocks)) {
+		arena->blocks = * (void **) block;
+		free(block);
+	}
+
+	while ((big = LIST_FIRST(&arena->big))) {
+		LIST_REMOVE(big, entry);
+		free(big);
+	}
+
+	memset(arena, 0, sizeof(qmap_arena_t));
+	LIST_INIT(&arena->big);
+}
+
+/* }}} */
+
+/* FILE {{{ */
+
+/* Grow the file of a map (qmap_fopen). Its mapping was
+ * reserved in full, so the new part goes right after the
+ * old one, and nothing we have pointers to ever moves.
+ */
+static void
+qmap_fextend(qmap_t *qmap, uint64_t need)
+{
+	qmap_fhdr_t *hdr = qmap->fhdr;
+	uint64_t cap = hdr->cap;
+
+	while (cap < need)
+		cap <<= 1;
+
+	CBUG(cap > QM_FILE_MAX, "File map too big\n");
+	CBUG(ftruncate(qmap->fd, cap), "ftruncate error\n");
+	CBUG(mmap(qmap->base + hdr->cap, cap - hdr->cap,
+				PROT_READ | PROT_WRITE,
+				MAP_SHARED | MAP_FIXED, qmap->fd,
+				hdr->cap) == MAP_FAILED,
+			"mmap error\n");
+
+	hdr->cap = cap;
+}
+
+/* Like the arena, but chunks are in the file, and free
+ * lists hold offsets so that they survive a reopen.
+ */
+static void *
+qmap_falloc(qmap_t *qmap, size_t len)
+{
+	qmap_fhdr_t *hdr = qmap->fhdr;
+	unsigned shift = len <= (1u << QM_FILE_MIN)
+		? QM_FILE_MIN
+		: 64 - __builtin_clzll((uint64_t) len - 1);
+	uint64_t *head, off;
+
+	CBUG(shift >= QM_FILE_MIN + QM_FILE_CLASSES,
+			"Too big for a file map\n");
+
+	head = &hdr->free[shift - QM_FILE_MIN];
+	if (*head && *head + (1ull << shift) > hdr->end) {
+		WARN("Bad free list, left behind\n");
+		*head = 0;
+	}
+
+	if (*head) {
+		off = *head;
+		*head = * (uint64_t *) (qmap->base + off);
+		return qmap->base + off;
+	}
+
+	if (hdr->end + (1ull << shift) > hdr->cap)
+		qmap_fextend(qmap, hdr->end + (1ull << shift));
+
+	off = hdr->end;
+	hdr->end += 1ull << shift;
+	return qmap->base + off;
+}
+
+static void
+qmap_ffree(qmap_t *qmap, void *ptr, size_t len)
+{
+	unsigned shift = len <= (1u << QM_FILE_MIN)
+		? QM_FILE_MIN
+		: 64 - __builtin_clzll((uint64_t) len - 1);
+	uint64_t *head = &qmap->fhdr->free[shift - QM_FILE_MIN];
+
+	* (uint64_t *) ptr = *head;
+	*head = (char *) ptr - qmap->base;
+}
+
+/* }}} */
+
 /* HELPER FUNCTIONS {{{ */
 
+#ifdef QM_INSTRUMENT
+static inline uint64_t
+qmap_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+/* Count an op that started at t, by the log2 of its ns */
+static inline void
+qmap_hist(qmap_t *qmap, enum qmap_op op, uint64_t t)
+{
+	uint64_t ns = qmap_ns() - t;
+	unsigned b = ns ? 64 - __builtin_clzll(ns) : 0;
+
+	b = b < QM_HIST ? b : QM_HIST - 1;
+	__atomic_fetch_add(&qmap->instr.hist[op][b], 1,
+			__ATOMIC_RELAXED);
+}
+#endif
+
+/* File maps keep offsets where others keep pointers.
+ * These go from one to the other.
+ */
+static inline void *
+qmap_ptr(qmap_t *qmap, const void *off)
+{
+	if (!off || !qmap->base)
+		return (void *) off;
+
+	// a file can hold anything: past its end is nothing
+	return (uintptr_t) off < qmap->fhdr->end
+		? qmap->base + (uintptr_t) off : NULL;
+}
+
+static inline void *
+qmap_off(qmap_t *qmap, const void *ptr)
+{
+	return qmap->base
+		? (void *) ((const char *) ptr - qmap->base)
+		: (void *) ptr;
+}
+
 /* Easily obtain the pointer to the key */
 static inline void *
 qmap_key(unsigned hd, unsigned n)
 {
-	qmap_t *qmap = &qmaps[hd];
-	return (void *) qmap->omap[n];
+	qmap_t *qmap = qmap_at(hd);
+	return qmap_ptr(qmap, qmap->omap[n]);
 }
 
 /* Easily obtain the pointer to the value */
 static inline void *
 qmap_val(unsigned hd, unsigned n) {
-	qmap_t *qmap = &qmaps[hd], *pqmap;
+	qmap_t *qmap = qmap_at(hd), *pqmap;
 
 	if (qmap->flags & QM_PGET)
 		return qmap_key(qmap->phd, n);
 
-	pqmap = &qmaps[qmap->phd];
-	return * VAL_ADDR(pqmap, n);
+	pqmap = qmap_at(qmap->phd);
+
+	// counters are right there
+	if (pqmap->flags & QM_COUNTER)
+		return VAL_ADDR(pqmap, n);
+
+	return qmap_ptr(pqmap, * VAL_ADDR(pqmap, n));
+}
+
+/* Allocate storage for a key or value of a primary */
+static inline void *
+qmap_salloc(qmap_t *qmap, size_t len)
+{
+	void *ret;
+
+	QM_COUNT(qmap, QM_C_ALLOCS, 1);
+
+	if (qmap->arena)
+		return qmap_arena_alloc(qmap->arena, len);
+
+	if (qmap->base)
+		return qmap_falloc(qmap, len);
+
+	ret = malloc(len);
+	CBUG(!ret, "malloc error\n");
+	return ret;
+}
+
+static inline void qmap_iref(const void *str);
+
+/* Keep a key or value of a primary. Borrowed ones
+ * (QM_BORROW) and interned strings (QM_ISTR) are kept as
+ * they are, others get copied.
+ */
+static inline void *
+qmap_scopy(qmap_t *qmap, enum QM_MBR mbr, const void *data,
+		size_t len)
+{
+	void *ret;
+
+	if (qmap->flags & QM_BORROW)
+		return (void *) data;
+
+	if (qmap->types[mbr] == QM_ISTR) {
+		qmap_iref(data);
+		return (void *) data;
+	}
+
+	ret = qmap_salloc(qmap, len);
+	memcpy(ret, data, len);
+	return ret;
+}
+
+/* Release what qmap_scopy kept, len bytes long */
+static inline void
+qmap_sfree(qmap_t *qmap, enum QM_MBR mbr, const void *ptr,
+		size_t len)
+{
+	if (qmap->flags & QM_BORROW)
+		return;
+
+	if (qmap->types[mbr] == QM_ISTR) {
+		qmap_unintern(ptr);
+		return;
+	}
+
+	QM_COUNT(qmap, QM_C_FREES, 1);
+
+	if (qmap->base) {
+		qmap_ffree(qmap, (void *) ptr, len);
+		return;
+	}
+
+	if (!qmap->arena) {
+		free((void *) ptr);
+		return;
+	}
+
+	qmap_arena_free(qmap->arena, (void *) ptr, len);
 }
 
-/* In some cases we want to calculate the id based on the
- * qmap's hash function and the key, and the mask. Other
- * times it's not useful to do that. This is for when it is.
+/* The length of the key or value at n. We kept it when
+ * it was put, unless its type has a fixed one.
  */
+static inline size_t
+qmap_nlen(qmap_t *qmap, enum QM_MBR mbr, unsigned n,
+		const void *ptr)
+{
+	return qmap->lens[mbr]
+		? qmap->lens[mbr][n]
+		: qmap_len(qmap->types[mbr], ptr);
+}
+
+/* Keep the lengths of what goes in n */
+static inline void
+qmap_nlen_set(qmap_t *qmap, enum QM_MBR mbr, unsigned n,
+		size_t len)
+{
+	if (qmap->lens[mbr])
+		qmap->lens[mbr][n] = len;
+}
+
+/* Hash a key we know the length of */
+static inline unsigned
+qmap_hashl(unsigned hd, const void * const key, size_t len)
+{
+	qmap_t *qmap = qmap_at(hd);
+	qmap_type_t *type = &qmap_types[qmap->types[QM_KEY]];
+
+	return qmap_fold(type->hash(key, len));
+}
+
+/* Hash a key, and tell us its length while at it. */
 static inline unsigned
-qmap_id(unsigned hd, const void * const key)
+qmap_hash(unsigned hd, const void * const key, size_t *len)
 {
-	qmap_t *qmap = &qmaps[hd];
+	qmap_t *qmap = qmap_at(hd);
 	qmap_type_t *type = &qmap_types[qmap->types[QM_KEY]];
-	size_t len = type->measure
+
+	*len = type->measure
 		? type->measure(key)
 		: type->len;
-	unsigned id = type->hash(key, len)
-		& qmap->mask;
-	unsigned n;
-	const void *okey;
 
-	if (qmap->types[QM_KEY] == QM_HNDL)
-		return id;
+	return qmap_fold(type->hash(key, *len));
+}
 
-	while (1) {
-		n = qmap->map[id];
-		if (n == QM_MISS)
-			break;
-		okey = qmap_key(hd, n);
-		if (!type->cmp(okey, key, len))
-			break;
-		id ++;
-		id &= qmap->mask;
+/* Match a group of control bytes against a hash.
+ *
+ * @param empty
+ * 	Gets a bit set for each empty id in the group.
+ *
+ * @returns
+ * 	A bit set for each id whose 7 bits match.
+ */
+static inline unsigned
+qmap_group(const unsigned char *ctrl, unsigned char h7,
+		unsigned *empty)
+{
+#if defined(__AVX2__)
+	__m256i g = _mm256_loadu_si256((const __m256i *) ctrl);
+
+	*empty = (unsigned) _mm256_movemask_epi8(g);
+	return (unsigned) _mm256_movemask_epi8(
+			_mm256_cmpeq_epi8(g,
+				_mm256_set1_epi8((char) h7)));
+#elif defined(__SSE2__)
+	__m128i g = _mm_loadu_si128((const __m128i *) ctrl);
+
+	*empty = (unsigned) _mm_movemask_epi8(g);
+	return (unsigned) _mm_movemask_epi8(
+			_mm_cmpeq_epi8(g,
+				_mm_set1_epi8((char) h7)));
+#else
+	unsigned i, match = 0;
+
+	*empty = 0;
+	for (i = 0; i < QM_GROUP; i++) {
+		*empty |= (unsigned) (ctrl[i] >> 7) << i;
+		match |= (unsigned) (ctrl[i] == h7) << i;
 	}
 
-	return id;
+	return match;
+#endif
 }
 
-/* }}} */
+static inline void
+qmap_idx_init(qmap_idx_t *idx, unsigned len)
+{
+	idx->slots = malloc(len * sizeof(qmap_slot_t));
+	idx->ctrl = malloc(len + QM_GROUP);
+	CBUG(!(idx->slots && idx->ctrl), "malloc error\n");
+	idx->mask = len - 1;
+	memset(idx->slots, 0xFF, len * sizeof(qmap_slot_t));
+	memset(idx->ctrl, QM_EMPTY, len + QM_GROUP);
+}
 
-/* OPEN / INITIALIZATION {{{ */
+static inline void
+qmap_idx_free(qmap_idx_t *idx)
+{
+	free(idx->slots);
+	free(idx->ctrl);
+	idx->slots = NULL;
+	idx->ctrl = NULL;
+}
 
-/* Low level way of opening databases. */
-static unsigned
-_qmap_open(unsigned ktype, unsigned vtype,
-		unsigned mask, unsigned flags)
+/* Set the control byte of an id, and its copies */
+static inline void
+qmap_ctrl(qmap_idx_t *idx, unsigned id, unsigned char c)
 {
-	unsigned hd = idm_new(&idm);
-	qmap_t *qmap = &qmaps[hd];
-	unsigned len;
-	size_t ids_len;
+	unsigned len = idx->mask + 1;
 
-	mask = mask ? mask : QM_DEFAULT_MASK;
+	idx->ctrl[id] = c;
+	for (id += len; id < len + QM_GROUP; id += len)
+		idx->ctrl[id] = c;
+}
 
-	DEBUG(1, "%u %u 0x%x %u\n",
-			hd, ktype,
-			mask, flags);
+// what follows is the probe of QM_PROBE 1: bump it
+#if QM_PROBE != 1
+#error "Update qmap_probe, qmap_place and qmap.hpp's get"
+#endif
 
-	len = mask + 1u;
+/* Look for a key in an id -> n map. That might be the
+ * current one, or the one we are growing from. We only
+ * compare keys whose control byte matches. And since Robin
+ * Hood keeps clusters ordered by distance from home, we
+ * can stop once the last of a group is closer than us.
+ *
+ * Positions of m or more, and missing keys, are skipped.
+ * Those only show up to QM_LOCKFREE readers, while a
+ * writer is still halfway through.
+ *
+ * @returns	The id, or QM_MISS if not found.
+ */
+static inline unsigned
+qmap_probe(unsigned hd, qmap_idx_t *idx,
+		const void * const key, size_t len,
+		unsigned hash, unsigned m)
+{
+	qmap_t *qmap = qmap_at(hd);
+	qmap_type_t *type = &qmap_types[qmap->types[QM_KEY]];
+	unsigned home = hash & idx->mask, d;
+	unsigned char h7 = QM_H7(hash);
+
+	QM_COUNT(qmap, QM_C_LOOKUPS, 1);
+
+	for (d = 0; d <= idx->mask; d += QM_GROUP) {
+		unsigned base = (home + d) & idx->mask, empty, id;
+		unsigned match = qmap_group(idx->ctrl + base,
+				h7, &empty);
+
+		QM_COUNT(qmap, QM_C_GROUPS, 1);
+
+		// nothing past the first empty
+		if (empty)
+			match &= (empty & -empty) - 1;
+
+		for (; match; match &= match - 1) {
+			const void *skey;
+			unsigned n;
+
+			id = (base + __builtin_ctz(match))
+				& idx->mask;
+			n = idx->slots[id].n;
+
+			if (idx->slots[id].hash != hash || n >= m)
+				continue;
+
+			skey = qmap_key(hd, n);
+			if (!skey)
+				continue;
+
+			// readers can see a key that took n after we
+			// read the slot, and it may be shorter than ours
+			if (qmap->flags & QM_LOCKFREE) {
+				if (type->measure
+						&& type->measure(skey) != len)
+					continue;
+			} else if (qmap->lens[QM_KEY]
+					&& qmap->lens[QM_KEY][n] != len)
+				continue;
+
+			QM_COUNT(qmap, QM_C_CMPS, 1);
+			if (!type->cmp(skey, key, len))
+				return id;
+		}
 
-	CBUG((len & mask) != 0, "mask must be 2^k - 1\n");
-	ids_len = len * sizeof(unsigned);
+		id = (base + QM_GROUP - 1) & idx->mask;
+		if (empty || qmap_slot_dist(idx, id)
+				< d + QM_GROUP - 1)
+			break;
+	}
 
-	qmap->map = malloc(ids_len);
-	qmap->omap = malloc(len * sizeof(void *));
-	CBUG(!(qmap->map && qmap->omap), "malloc error\n");
-	qmap->m = len;
-	qmap->types[QM_KEY] = ktype;
-	qmap->types[QM_VALUE] = vtype;
-	qmap->mask = mask;
+	return QM_MISS;
+}
+
+/* Look for the id of a position we know the hash of.
+ * No need to look at keys for that.
+ */
+static inline unsigned
+qmap_seek(qmap_idx_t *idx, unsigned hash, unsigned n)
+{
+	unsigned id = hash & idx->mask, d;
+
+	for (d = 0; idx->slots[id].n != QM_MISS
+			&& qmap_slot_dist(idx, id) >= d; d++)
+	{
+		if (idx->slots[id].n == n)
+			return id;
+
+		id = (id + 1) & idx->mask;
+	}
+
+	return QM_MISS;
+}
+
+/* Put a position into an id -> n map, taking the slot of
+ * any entry that is closer to its home than we are, and
+ * carrying that one forward instead (Robin Hood).
+ *
+ * @returns	The id where n ended up.
+ */
+static inline unsigned
+qmap_place(qmap_idx_t *idx, unsigned hash, unsigned n)
+{
+	qmap_slot_t cur = { .n = n, .hash = hash }, tmp;
+	unsigned id = hash & idx->mask, ret = QM_MISS, d, td;
+
+	for (d = 0;; d++, id = (id + 1) & idx->mask) {
+		if (idx->slots[id].n == QM_MISS) {
+			idx->slots[id] = cur;
+			qmap_ctrl(idx, id, QM_H7(cur.hash));
+			return ret == QM_MISS ? id : ret;
+		}
+
+		td = qmap_slot_dist(idx, id);
+		if (td >= d)
+			continue;
+
+		tmp = idx->slots[id];
+		idx->slots[id] = cur;
+		qmap_ctrl(idx, id, QM_H7(cur.hash));
+		cur = tmp;
+		d = td;
+		if (ret == QM_MISS)
+			ret = id;
+	}
+}
+
+/* Empty an id, shifting the rest of the cluster back
+ * so no tombstones are needed (backward-shift deletion).
+ */
+static inline void
+qmap_shift(qmap_idx_t *idx, unsigned id)
+{
+	unsigned next = (id + 1) & idx->mask;
+
+	while (idx->slots[next].n != QM_MISS
+			&& qmap_slot_dist(idx, next))
+	{
+		idx->slots[id] = idx->slots[next];
+		qmap_ctrl(idx, id, idx->ctrl[next]);
+		id = next;
+		next = (next + 1) & idx->mask;
+	}
+
+	idx->slots[id].n = QM_MISS;
+	qmap_ctrl(idx, id, QM_EMPTY);
+}
+
+/* Find the position of a key we already hashed. While
+ * growing, keys that were not moved yet are only in gmap.
+ */
+static inline unsigned
+qmap_lookup(unsigned hd, const void * const key,
+		size_t len, unsigned hash)
+{
+	qmap_t *qmap = qmap_at(hd);
+	unsigned id;
+
+	id = qmap_probe(hd, &qmap->map, key, len, hash, qmap->m);
+
+	if (id != QM_MISS)
+		return qmap->map.slots[id].n;
+
+	if (!qmap->gmap.slots)
+		return QM_MISS;
+
+	id = qmap_probe(hd, &qmap->gmap, key, len,
+			hash, qmap->m);
+
+	return id == QM_MISS ? QM_MISS
+		: qmap->gmap.slots[id].n;
+}
+
+/* The primary at the top of a chain of secondaries */
+static inline unsigned
+qmap_root(unsigned hd)
+{
+	while(qmap_at(hd)->phd != hd)
+		hd = qmap_at(hd)->phd;
+
+	return hd;
+}
+
+/* Start loading what a probe for this hash will read */
+static inline void
+qmap_prefetch(unsigned hd, unsigned hash)
+{
+	qmap_idx_t *idx = &qmap_at(hd)->map;
+	unsigned id = hash & idx->mask;
+
+	__builtin_prefetch(idx->ctrl + id);
+	__builtin_prefetch(idx->slots + id);
+}
+
+/* Which shard of a QM_CONCURRENT map holds a hash. The
+ * multiply spreads QM_HNDL keys, which aren't hashed.
+ */
+static inline unsigned
+qmap_shard_id(unsigned hash)
+{
+	return (hash * 0x9E3779B1u) >> (32 - QM_SHARD_BITS);
+}
+
+static inline qmap_shard_t *
+qmap_shard(unsigned hd, unsigned hash)
+{
+	return &qmap_at(hd)->shards[qmap_shard_id(hash)];
+}
+
+/* Thread exit: drop its cursor handles */
+static void
+qmap_cur_free(void *data UNUSED)
+{
+	free(qmap_cursors);
+	idm_drop(&cursor_idm);
+	qmap_cursors = NULL;
+	cursors_cap = 0;
+}
+
+/* Get a cursor handle of this thread. The pool doubles
+ * when it runs out, so there's no limit.
+ */
+static inline unsigned
+qmap_cur_new(void)
+{
+	unsigned cur_id = idm_new(&cursor_idm);
+
+	if (cur_id < cursors_cap)
+		return cur_id;
+
+	if (!cursors_cap)
+		pthread_setspecific(cursor_key, &cursor_idm);
+
+	cursors_cap = cursors_cap ? cursors_cap * 2 : 16;
+	qmap_cursors = realloc(qmap_cursors,
+			cursors_cap * sizeof(qmap_cur_t));
+	CBUG(!qmap_cursors, "malloc error\n");
+	return cur_id;
+}
+
+static inline void
+qmap_cur_del(unsigned cur_id)
+{
+	idm_del(&cursor_idm, cur_id);
+}
+
+/* Forget the id of position n */
+static inline void
+qmap_unslot(unsigned hd, unsigned n)
+{
+	qmap_t *qmap = qmap_at(hd);
+	qmap_idx_t *idx = &qmap->map;
+	unsigned hash = qmap->ohash[n];
+	unsigned id = qmap_seek(idx, hash, n);
+
+	if (id == QM_MISS && qmap->gmap.slots) {
+		idx = &qmap->gmap;
+		id = qmap_seek(idx, hash, n);
+	}
+
+	if (id == QM_MISS)
+		return;
+
+	qmap_shift(idx, id);
+	qmap->count--;
+}
+
+/* }}} */
+
+/* LOCK-FREE READERS {{{ */
+
+/* Put something a writer took out on hold, until no
+ * reader can be looking at it. Other maps free it now.
+ */
+static inline void
+qmap_retire(qmap_t *qmap, enum QM_MBR mbr, const void *ptr,
+		size_t len)
+{
+	qmap_retired_t *r;
+
+	if (!(qmap->flags & QM_LOCKFREE)) {
+		if (mbr == QM_RAW)
+			free((void *) ptr);
+		else
+			qmap_sfree(qmap, mbr, ptr, len);
+		return;
+	}
+
+	if (qmap->retired_n >= qmap->retired_cap) {
+		qmap->retired_cap = qmap->retired_cap
+			? qmap->retired_cap * 2 : 64;
+		qmap->retired = realloc(qmap->retired,
+				qmap->retired_cap
+				* sizeof(qmap_retired_t));
+		CBUG(!qmap->retired, "malloc error\n");
+	}
+
+	// qmap_wend gives it an epoch
+	r = &qmap->retired[qmap->retired_n++];
+	r->ptr = ptr;
+	r->epoch = ULONG_MAX;
+	r->mbr = mbr;
+	r->len = len;
+}
+
+static inline void
+qmap_idx_retire(qmap_t *qmap, qmap_idx_t *idx)
+{
+	qmap_retire(qmap, QM_RAW, idx->slots, 0);
+	qmap_retire(qmap, QM_RAW, idx->ctrl, 0);
+	idx->slots = NULL;
+	idx->ctrl = NULL;
+}
+
+/* Like realloc, but readers can keep using the old one */
+static inline void *
+qmap_realloc(qmap_t *qmap, void *ptr, size_t olen, size_t len)
+{
+	void *ret;
+
+	if (!(qmap->flags & QM_LOCKFREE)) {
+		ret = realloc(ptr, len);
+		CBUG(!ret, "malloc error\n");
+		return ret;
+	}
+
+	ret = malloc(len);
+	CBUG(!ret, "malloc error\n");
+	memcpy(ret, ptr, olen);
+	qmap_retire(qmap, QM_RAW, ptr, 0);
+	return ret;
+}
+
+/* Free what was retired before "min". With no readers
+ * (ULONG_MAX), free it all.
+ */
+static void
+qmap_reclaim(qmap_t *qmap, unsigned long min)
+{
+	unsigned i, j = 0;
+
+	for (i = 0; i < qmap->retired_n; i++) {
+		qmap_retired_t *r = &qmap->retired[i];
+
+		if (min != ULONG_MAX && r->epoch >= min) {
+			qmap->retired[j++] = *r;
+			continue;
+		}
+
+		if (r->mbr == QM_RAW)
+			free((void *) r->ptr);
+		else
+			qmap_sfree(qmap, r->mbr, r->ptr, r->len);
+	}
+
+	qmap->retired_n = j;
+}
+
+/* Thread exit: let someone else have the slot */
+static void
+qmap_rfree(void *data)
+{
+	unsigned rid = (unsigned) (uintptr_t) data - 1;
+
+	pthread_mutex_lock(&qmap_lock);
+	idm_del(&reader_idm, rid);
+	pthread_mutex_unlock(&qmap_lock);
+}
+
+/* Announce an epoch no writer has moved past yet */
+static inline void
+qmap_announce(unsigned long *mine)
+{
+	unsigned long e;
+
+	do {
+		e = __atomic_load_n(&qmap_epoch, __ATOMIC_SEQ_CST);
+		__atomic_store_n(mine, e, __ATOMIC_SEQ_CST);
+	} while (__atomic_load_n(&qmap_epoch, __ATOMIC_SEQ_CST) != e);
+}
+
+/* Get a slot of our own. While all QM_READERS are taken,
+ * we read from the last one instead, along with others,
+ * under qmap_lock: the first of them announces, and the
+ * last to leave clears it. An epoch that old covers us
+ * too. We try for a slot again on the next enter.
+ */
+static void
+qmap_rreg(void)
+{
+	unsigned rid;
+
+	pthread_mutex_lock(&qmap_lock);
+	rid = idm_new(&reader_idm);
+
+	if (rid >= QM_READERS) {
+		idm_del(&reader_idm, rid);
+		qmap_rid = QM_READERS;
+		if (!qmap_rshared++)
+			qmap_announce(&qmap_readers[QM_READERS].epoch);
+		pthread_mutex_unlock(&qmap_lock);
+		return;
+	}
+
+	qmap_rid = rid;
+	if (rid >= qmap_nreaders)
+		__atomic_store_n(&qmap_nreaders, rid + 1,
+				__ATOMIC_SEQ_CST);
+	pthread_mutex_unlock(&qmap_lock);
+	pthread_setspecific(reader_key,
+			(void *) (uintptr_t) (rid + 1));
+}
+
+void /* API */
+qmap_enter(void)
+{
+	if (qmap_rnest++)
+		return;
+
+	if (qmap_rid == QM_MISS || qmap_rid == QM_READERS)
+		qmap_rreg();
+
+	if (qmap_rid != QM_READERS)
+		qmap_announce(&qmap_readers[qmap_rid].epoch);
+}
+
+void /* API */
+qmap_leave(void)
+{
+	if (--qmap_rnest)
+		return;
+
+	if (qmap_rid != QM_READERS) {
+		__atomic_store_n(&qmap_readers[qmap_rid].epoch, 0,
+				__ATOMIC_RELEASE);
+		return;
+	}
+
+	pthread_mutex_lock(&qmap_lock);
+	if (!--qmap_rshared)
+		__atomic_store_n(&qmap_readers[QM_READERS].epoch,
+				0, __ATOMIC_RELEASE);
+	pthread_mutex_unlock(&qmap_lock);
+}
+
+/* The oldest epoch a reader is in, or ULONG_MAX */
+static unsigned long
+qmap_rmin(void)
+{
+	unsigned n = __atomic_load_n(&qmap_nreaders,
+			__ATOMIC_SEQ_CST), i;
+	unsigned long min = ULONG_MAX, e;
+
+	for (i = 0; i < n; i++) {
+		e = __atomic_load_n(&qmap_readers[i].epoch,
+				__ATOMIC_SEQ_CST);
+		if (e && e < min)
+			min = e;
+	}
+
+	// and the shared one (see qmap_rreg)
+	e = __atomic_load_n(&qmap_readers[QM_READERS].epoch,
+			__ATOMIC_SEQ_CST);
+	return e && e < min ? e : min;
+}
+
+/* Start changing a QM_LOCKFREE map. Secondaries change
+ * along with their primary, so that one holds the lock.
+ */
+static inline qmap_t *
+qmap_wbegin(unsigned hd)
+{
+	qmap_t *qmap = qmap_at(qmap_root(hd));
+
+	if (!(qmap->flags & QM_LOCKFREE))
+		return NULL;
+
+	pthread_mutex_lock(&qmap->wlock);
+	__atomic_store_n(&qmap->seq, qmap->seq + 1,
+			__ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	return qmap;
+}
+
+static void
+qmap_wtag(qmap_t *qmap, unsigned long e, unsigned long min)
+{
+	idsi_t *cur = ids_iter(&qmap->linked);
+	unsigned ahd, i;
+
+	for (i = qmap->retired_n; i-- > 0
+			&& qmap->retired[i].epoch == ULONG_MAX;)
+		qmap->retired[i].epoch = e;
+
+	qmap_reclaim(qmap, min);
+
+	while (ids_next(&ahd, &cur))
+		qmap_wtag(qmap_at(ahd), e, min);
+}
+
+/* Done changing. What was retired meanwhile is tagged
+ * with the current epoch, which we then move past.
+ */
+static inline void
+qmap_wend(qmap_t *qmap)
+{
+	unsigned long e;
+
+	if (!qmap)
+		return;
+
+	__atomic_store_n(&qmap->seq, qmap->seq + 1,
+			__ATOMIC_RELEASE);
+	e = __atomic_fetch_add(&qmap_epoch, 1, __ATOMIC_SEQ_CST);
+	qmap_wtag(qmap, e, qmap_rmin());
+	pthread_mutex_unlock(&qmap->wlock);
+}
+
+/* Lookup without locks. We copy the indexes, check
+ * that no writer was at work meanwhile, and only then
+ * probe the copies. If one started, we retry. What we
+ * look at is kept alive by qmap_enter, but we leave
+ * before returning: past that, the value is only kept
+ * alive by an enter of the caller's own (see qmap.h).
+ *
+ * @param value	Gets the value, if found.
+ */
+static unsigned
+qmap_rlookup(unsigned hd, const void * const key,
+		size_t len, unsigned hash,
+		const void **value)
+{
+	qmap_t *qmap = qmap_at(hd);
+	qmap_t *rqmap = qmap_at(qmap_root(hd));
+	qmap_idx_t map, gmap;
+	unsigned seq, n, id, m;
+
+	qmap_enter();
+again:
+	while ((seq = __atomic_load_n(&rqmap->seq,
+					__ATOMIC_ACQUIRE)) & 1)
+		;
+
+	m = __atomic_load_n(&qmap->m, __ATOMIC_ACQUIRE);
+	map = qmap->map;
+	gmap = qmap->gmap;
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	if (__atomic_load_n(&rqmap->seq, __ATOMIC_RELAXED) != seq)
+		goto again;
+
+	n = QM_MISS;
+	id = qmap_probe(hd, &map, key, len, hash, m);
+	if (id != QM_MISS)
+		n = map.slots[id].n;
+	else if (gmap.slots) {
+		id = qmap_probe(hd, &gmap, key, len, hash, m);
+		if (id != QM_MISS)
+			n = gmap.slots[id].n;
+	}
+
+	*value = n < m ? qmap_val(hd, n) : NULL;
+
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	if (__atomic_load_n(&rqmap->seq, __ATOMIC_RELAXED) != seq)
+		goto again;
+
+	qmap_leave();
+	return n < m ? n : QM_MISS;
+}
+
+/* }}} */
+
+/* ORDERED INDEX {{{ */
+
+/* Order the key at position n of a map (QM_SORTED) and
+ * "key", which is len long. cmp is positive when its
+ * first argument goes first; we compare up to the
+ * shorter key, and then the shorter one goes first.
+ * The one at n has its length kept (qmap_nlen).
+ */
+static inline int
+qmap_order(unsigned hd, unsigned n,
+		const void * const key, size_t len)
+{
+	qmap_t *qmap = qmap_at(hd);
+	const void *a = qmap_key(hd, n);
+	size_t la = qmap_nlen(qmap, QM_KEY, n, a);
+	int ret = qmap_types[qmap->types[QM_KEY]].cmp(key, a,
+			la < len ? la : len);
+
+	return ret ? ret : (la > len) - (la < len);
+}
+
+static qmap_bt_t *
+qmap_bt_new(unsigned leaf)
+{
+	qmap_bt_t *node = malloc(sizeof(qmap_bt_t) + (leaf
+				? 0 : QM_BT_ORDER * sizeof(qmap_bt_t *)));
+
+	CBUG(!node, "malloc error\n");
+	node->n = 0;
+	node->leaf = leaf;
+	node->prev = node->next = NULL;
+	return node;
+}
+
+static void
+qmap_bt_free(qmap_bt_t *node)
+{
+	unsigned i;
+
+	if (!node->leaf)
+		for (i = 0; i < node->n; i++)
+			qmap_bt_free(node->kids[i]);
+
+	free(node);
+}
+
+/* The first index whose key isn't before "key" */
+static inline unsigned
+qmap_bt_lower(unsigned hd, qmap_bt_t *node,
+		const void * const key, size_t len)
+{
+	unsigned lo = 0, hi = node->n, mid;
+
+	while (lo < hi) {
+		mid = (lo + hi) >> 1;
+		if (qmap_order(hd, node->pos[mid], key, len) < 0)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	return lo;
+}
+
+/* The child of an inner node where "key" belongs */
+static inline unsigned
+qmap_bt_child(unsigned hd, qmap_bt_t *node,
+		const void * const key, size_t len)
+{
+	unsigned lo = 1, hi = node->n, mid;
+
+	while (lo < hi) {
+		mid = (lo + hi) >> 1;
+		if (qmap_order(hd, node->pos[mid], key, len) <= 0)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	return lo - 1;
+}
+
+/* Put a position (and child) at index i of a node that
+ * has room for it.
+ */
+static inline void
+qmap_bt_insert(qmap_bt_t *node, unsigned i,
+		unsigned n, qmap_bt_t *kid)
+{
+	memmove(node->pos + i + 1, node->pos + i,
+			(node->n - i) * sizeof(unsigned));
+	node->pos[i] = n;
+
+	if (!node->leaf) {
+		memmove(node->kids + i + 1, node->kids + i,
+				(node->n - i) * sizeof(qmap_bt_t *));
+		node->kids[i] = kid;
+	}
+
+	node->n++;
+}
+
+/* Insert at index i, splitting the node if it is full.
+ *
+ * @returns	The new right half, or NULL.
+ */
+static qmap_bt_t *
+qmap_bt_place(qmap_bt_t *node, unsigned i,
+		unsigned n, qmap_bt_t *kid)
+{
+	unsigned half = QM_BT_ORDER / 2;
+	qmap_bt_t *right;
+
+	if (node->n < QM_BT_ORDER) {
+		qmap_bt_insert(node, i, n, kid);
+		return NULL;
+	}
+
+	right = qmap_bt_new(node->leaf);
+	right->n = node->n - half;
+	memcpy(right->pos, node->pos + half,
+			right->n * sizeof(unsigned));
+	if (!node->leaf)
+		memcpy(right->kids, node->kids + half,
+				right->n * sizeof(qmap_bt_t *));
+	else {
+		right->next = node->next;
+		right->prev = node;
+		if (node->next)
+			node->next->prev = right;
+		node->next = right;
+	}
+
+	node->n = half;
+
+	if (i <= half)
+		qmap_bt_insert(node, i, n, kid);
+	else
+		qmap_bt_insert(right, i - half, n, kid);
+
+	return right;
+}
+
+static qmap_bt_t *
+qmap_bt_ins(unsigned hd, qmap_bt_t *node, unsigned n,
+		const void * const key, size_t len)
+{
+	qmap_bt_t *right;
+	unsigned i;
+
+	if (node->leaf)
+		return qmap_bt_place(node,
+				qmap_bt_lower(hd, node, key, len),
+				n, NULL);
+
+	i = qmap_bt_child(hd, node, key, len);
+	right = qmap_bt_ins(hd, node->kids[i], n, key, len);
+	node->pos[i] = node->kids[i]->pos[0];
+
+	if (!right)
+		return NULL;
+
+	return qmap_bt_place(node, i + 1, right->pos[0], right);
+}
+
+/* Add position n, which has its key in place already */
+static void
+qmap_bt_put(unsigned hd, unsigned n)
+{
+	qmap_t *qmap = qmap_at(hd);
+	const void *key = qmap_key(hd, n);
+	qmap_bt_t *right, *root;
+
+	if (!qmap->bt)
+		qmap->bt = qmap_bt_new(1);
+
+	right = qmap_bt_ins(hd, qmap->bt, n, key,
+			qmap_nlen(qmap, QM_KEY, n, key));
+	if (!right)
+		return;
+
+	root = qmap_bt_new(0);
+	root->n = 2;
+	root->pos[0] = qmap->bt->pos[0];
+	root->kids[0] = qmap->bt;
+	root->pos[1] = right->pos[0];
+	root->kids[1] = right;
+	qmap->bt = root;
+}
+
+/* Take out position n. Nodes that get empty go away, but
+ * we don't merge the rest (deletes never make it taller).
+ *
+ * @returns	1 if it was there.
+ */
+static int
+qmap_bt_rm(unsigned hd, qmap_bt_t *node, unsigned n,
+		const void * const key, size_t len)
+{
+	qmap_bt_t *kid;
+	unsigned i;
+
+	if (node->leaf) {
+		i = qmap_bt_lower(hd, node, key, len);
+		if (i >= node->n || node->pos[i] != n)
+			return 0;
+
+		memmove(node->pos + i, node->pos + i + 1,
+				(node->n - i - 1) * sizeof(unsigned));
+		node->n--;
+		return 1;
+	}
+
+	i = qmap_bt_child(hd, node, key, len);
+	kid = node->kids[i];
+	if (!qmap_bt_rm(hd, kid, n, key, len))
+		return 0;
+
+	if (kid->n) {
+		node->pos[i] = kid->pos[0];
+		return 1;
+	}
+
+	if (kid->leaf) {
+		if (kid->prev)
+			kid->prev->next = kid->next;
+		if (kid->next)
+			kid->next->prev = kid->prev;
+	}
+
+	free(kid);
+	memmove(node->pos + i, node->pos + i + 1,
+			(node->n - i - 1) * sizeof(unsigned));
+	memmove(node->kids + i, node->kids + i + 1,
+			(node->n - i - 1) * sizeof(qmap_bt_t *));
+	node->n--;
+	return 1;
+}
+
+static void
+qmap_bt_del(unsigned hd, unsigned n, const void * const key)
+{
+	qmap_t *qmap = qmap_at(hd);
+	qmap_bt_t *root = qmap->bt;
+
+	if (!root || !qmap_bt_rm(hd, root, n, key,
+				qmap_nlen(qmap, QM_KEY, n, key)))
+		return;
+
+	while (!root->leaf && root->n == 1) {
+		qmap->bt = root->kids[0];
+		free(root);
+		root = qmap->bt;
+	}
+
+	if (!root->leaf && !root->n) {
+		free(root);
+		qmap->bt = NULL;
+	}
+}
+
+/* Find the leaf and index of the first key that isn't
+ * before "key" (or the very first one, with NULL).
+ */
+static qmap_bt_t *
+qmap_bt_seek(unsigned hd, const void * const key,
+		unsigned *idx)
+{
+	qmap_bt_t *node = qmap_at(hd)->bt;
+	size_t len;
+
+	*idx = 0;
+	if (!node)
+		return NULL;
+
+	// measured once, for all the compares
+	len = key ? qmap_len(qmap_at(hd)->types[QM_KEY], key) : 0;
+
+	while (!node->leaf)
+		node = node->kids[key
+			? qmap_bt_child(hd, node, key, len) : 0];
+
+	if (key)
+		*idx = qmap_bt_lower(hd, node, key, len);
+
+	return node;
+}
+
+/* }}} */
+
+/* STRING POOL {{{ */
+
+static inline qmap_istr_t *
+qmap_istr(const void *str)
+{
+	return (qmap_istr_t *) ((char *) str
+			- offsetof(qmap_istr_t, str));
+}
+
+/* The position of a string in the pool, or QM_MISS.
+ * Call with the pool locked.
+ */
+static unsigned
+qmap_pool_find(const char *str, size_t len, unsigned hash)
+{
+	qmap_idx_t *idx = &qmap_pool.idx;
+	unsigned d, id;
+
+	if (!idx->slots)
+		return QM_MISS;
+
+	for (d = 0; d <= idx->mask; d++) {
+		qmap_istr_t *istr;
+
+		id = (hash + d) & idx->mask;
+		if (idx->slots[id].n == QM_MISS
+				|| qmap_slot_dist(idx, id) < d)
+			break;
+
+		istr = qmap_pool.entries[idx->slots[id].n];
+		if (idx->slots[id].hash == hash && istr->len == len
+				&& !memcmp(istr->str, str, len))
+			return istr->n;
+	}
+
+	return QM_MISS;
+}
+
+/* Double the pool's index. Positions stay the same. */
+static void
+qmap_pool_grow(void)
+{
+	qmap_idx_t *idx = &qmap_pool.idx;
+	unsigned olen = idx->slots ? idx->mask + 1 : 0;
+	unsigned len = olen ? olen << 1 : QM_POOL_MIN, n;
+
+	qmap_idx_free(idx);
+	qmap_idx_init(idx, len);
+	qmap_pool.entries = realloc(qmap_pool.entries,
+			len * sizeof(qmap_istr_t *));
+	CBUG(!qmap_pool.entries, "malloc error\n");
+	memset(qmap_pool.entries + olen, 0,
+			(len - olen) * sizeof(qmap_istr_t *));
+
+	for (n = 0; n < olen; n++)
+		if (qmap_pool.entries[n])
+			qmap_place(idx, qmap_fold(
+					qmap_pool.entries[n]->hash), n);
+}
+
+/* Another holder of an interned string. It already has
+ * one, so it can't be going away meanwhile.
+ */
+static inline void
+qmap_iref(const void *str)
+{
+	__atomic_add_fetch(&qmap_istr(str)->refs, 1,
+			__ATOMIC_RELAXED);
+}
+
+static size_t
+qmap_istr_measure(const void *str)
+{
+	return qmap_istr(str)->len;
+}
+
+static uint64_t
+qmap_istr_hash(const void * const key, size_t len UNUSED)
+{
+	return qmap_istr(key)->hash;
+}
+
+/* Each string is there once, so the same pointer is the
+ * same string. Contents only matter for order.
+ */
+static int
+qmap_istr_cmp(const void * const a, const void * const b,
+		size_t len)
+{
+	return a == b ? 0 : qmap_ccmp(a, b, len);
+}
+
+const char * /* API */
+qmap_intern(const char *str)
+{
+	size_t len = strlen(str) + 1;
+	uint64_t h = qmap_hash_xxh3(str, len);
+	unsigned hash = qmap_fold(h), n, cap;
+	qmap_istr_t *istr;
+
+	pthread_mutex_lock(&qmap_pool.lock);
+	n = qmap_pool_find(str, len, hash);
+	if (n != QM_MISS) {
+		istr = qmap_pool.entries[n];
+		qmap_iref(istr->str);
+		pthread_mutex_unlock(&qmap_pool.lock);
+		return istr->str;
+	}
+
+	cap = qmap_pool.idx.slots ? qmap_pool.idx.mask + 1 : 0;
+	if (qmap_pool.count >= cap - (cap >> 2))
+		qmap_pool_grow();
+
+	istr = malloc(sizeof(qmap_istr_t) + len);
+	CBUG(!istr, "malloc error\n");
+	istr->hash = h;
+	istr->refs = 1;
+	istr->len = len;
+	memcpy(istr->str, str, len);
+
+	istr->n = n = idm_new(&qmap_pool.idm);
+	qmap_pool.entries[n] = istr;
+	qmap_place(&qmap_pool.idx, hash, n);
+	qmap_pool.count++;
+	pthread_mutex_unlock(&qmap_pool.lock);
+	return istr->str;
+}
+
+const char * /* API */
+qmap_interned(const char *str)
+{
+	size_t len = strlen(str) + 1;
+	unsigned n;
+	const char *ret = NULL;
+
+	pthread_mutex_lock(&qmap_pool.lock);
+	n = qmap_pool_find(str, len,
+			qmap_fold(qmap_hash_xxh3(str, len)));
+	if (n != QM_MISS)
+		ret = qmap_pool.entries[n]->str;
+	pthread_mutex_unlock(&qmap_pool.lock);
+	return ret;
+}
+
+void /* API */
+qmap_unintern(const char *str)
+{
+	qmap_istr_t *istr = qmap_istr(str);
+	unsigned refs = __atomic_load_n(&istr->refs,
+			__ATOMIC_RELAXED);
+
+	// most aren't the last one, and don't need the lock
+	while (refs > 1)
+		if (__atomic_compare_exchange_n(&istr->refs, &refs,
+					refs - 1, 0, __ATOMIC_ACQ_REL,
+					__ATOMIC_RELAXED))
+			return;
+
+	pthread_mutex_lock(&qmap_pool.lock);
+	if (__atomic_sub_fetch(&istr->refs, 1, __ATOMIC_ACQ_REL)) {
+		pthread_mutex_unlock(&qmap_pool.lock);
+		return;
+	}
+
+	qmap_shift(&qmap_pool.idx, qmap_seek(&qmap_pool.idx,
+				qmap_fold(istr->hash), istr->n));
+	qmap_pool.entries[istr->n] = NULL;
+	idm_del(&qmap_pool.idm, istr->n);
+	qmap_pool.count--;
+	pthread_mutex_unlock(&qmap_pool.lock);
+	free(istr);
+}
+
+/* }}} */
+
+/* OPEN / INITIALIZATION {{{ */
+
+/* Reserve chunk c of the handle table (see qmaps) */
+static void
+qmap_chunk(unsigned c)
+{
+	qmap_t *chunk = mmap(NULL, QM_CHUNK * sizeof(qmap_t),
+			PROT_READ | PROT_WRITE, MAP_PRIVATE
+			| MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+
+	CBUG(chunk == MAP_FAILED, "mmap error\n");
+
+	// threads using maps of other chunks may look
+	__atomic_store_n(&qmaps[c], chunk, __ATOMIC_RELEASE);
+}
+
+/* Take a free handle. Or two in a row, for QM_MIRROR,
+ * since its secondary is always hd + 1.
+ */
+static unsigned
+qmap_hd_new(int pair)
+{
+	unsigned hd, c;
+
+	pthread_mutex_lock(&qmap_lock);
+	hd = pair ? idm_new_pair(&idm) : idm_new(&idm);
+	CBUG(hd + !!pair >= QM_MISS, "Too many maps\n");
+
+	// a pair can start a chunk, or end one
+	for (c = hd >> QM_CHUNK_BITS;
+			c <= (hd + !!pair) >> QM_CHUNK_BITS; c++)
+		if (!qmaps[c])
+			qmap_chunk(c);
+	pthread_mutex_unlock(&qmap_lock);
+
+	return hd;
+}
+
+/* Low level way of opening databases. */
+static unsigned
+_qmap_open(unsigned hd, unsigned ktype, unsigned vtype,
+		unsigned mask, unsigned flags)
+{
+	qmap_t *qmap = qmap_at(hd);
+	unsigned len, mbr;
+
+	mask = mask ? mask : QM_DEFAULT_MASK;
+
+	DEBUG(1, "%u %u 0x%x %u\n",
+			hd, ktype,
+			mask, flags);
+
+	len = mask + 1u;
+
+	CBUG((len & mask) != 0, "mask must be 2^k - 1\n");
+	qmap_idx_init(&qmap->map, len);
+	qmap->omap = malloc(len * sizeof(void *));
+	qmap->ohash = malloc(len * sizeof(unsigned));
+	CBUG(!(qmap->omap && qmap->ohash), "malloc error\n");
+	qmap->m = len;
+	qmap->types[QM_KEY] = ktype;
+	qmap->types[QM_VALUE] = vtype;
 	qmap->flags = flags;
 	qmap->idm = idm_init();
+
+	for (mbr = QM_KEY; mbr <= QM_VALUE; mbr++) {
+		qmap->lens[mbr] = NULL;
+		if (!qmap_types[qmap->types[mbr]].measure)
+			continue;
+
+		qmap->lens[mbr] = malloc(len * sizeof(unsigned));
+		CBUG(!qmap->lens[mbr], "malloc error\n");
+	}
+
 	qmap->phd = hd;
 	qmap->linked = ids_init();
+	qmap->count = 0;
+	qmap->gmap.slots = NULL;
+	qmap->gmap.ctrl = NULL;
+	qmap->arena = NULL;
+	qmap->shards = NULL;
+	qmap->bt = NULL;
+	qmap->base = NULL;
+	qmap->fhdr = NULL;
+	qmap->wal = NULL;
+	qmap->seq = 0;
+#ifdef QM_INSTRUMENT
+	memset(&qmap->instr, 0, sizeof(qmap->instr));
+#endif
+	qmap->retired = NULL;
+	qmap->retired_n = qmap->retired_cap = 0;
+
+	if (flags & QM_LOCKFREE)
+		pthread_mutex_init(&qmap->wlock, NULL);
+
+	if (flags & QM_ARENA) {
+		qmap->arena = calloc(1, sizeof(qmap_arena_t));
+		CBUG(!qmap->arena, "malloc error\n");
+		LIST_INIT(&qmap->arena->big);
+	}
+
+	// STORE {{{
+	qmap->table = malloc(sizeof(void *) * len);
+	memset(qmap->table, 0, sizeof(void *) * len);
+	// }}}
+
+	memset(qmap->omap, 0, sizeof(void *) * len);
+
+	return hd;
+}
+
+/* A QM_CONCURRENT map is a front with no entries of its
+ * own, and QM_SHARDS maps behind it. Each of those gets
+ * an even part of the size, and a lock.
+ */
+static unsigned
+qmap_sopen(unsigned ktype, unsigned vtype,
+		unsigned mask, unsigned flags)
+{
+	unsigned hd = _qmap_open(qmap_hd_new(0),
+			ktype, vtype, 1, flags), i;
+	unsigned len = ((mask ? mask : QM_DEFAULT_MASK) + 1u)
+		/ QM_SHARDS;
+	qmap_t *qmap = qmap_at(hd);
+
+	CBUG(flags & (QM_MIRROR | QM_AINDEX | QM_LOCKFREE),
+			"QM_CONCURRENT maps can't have QM_MIRROR, "
+			"QM_AINDEX or QM_LOCKFREE\n");
+
+	len = len < 2 ? 2 : len;
+	flags &= ~QM_CONCURRENT;
+	qmap->shards = malloc(QM_SHARDS * sizeof(qmap_shard_t));
+	CBUG(!qmap->shards, "malloc error\n");
+
+	for (i = 0; i < QM_SHARDS; i++) {
+		qmap_shard_t *shard = &qmap->shards[i];
+
+		pthread_mutex_init(&shard->lock, NULL);
+		shard->hd = _qmap_open(qmap_hd_new(0),
+				ktype, vtype,
+				len - 1, flags);
+	}
+
+	return hd;
+}
+
+unsigned /* API */
+qmap_open(unsigned ktype, unsigned vtype,
+		unsigned mask, unsigned flags)
+{
+	unsigned hd;
+
+	CBUG((flags & QM_SORTED) && (flags
+				& (QM_CONCURRENT | QM_LOCKFREE)),
+			"QM_SORTED maps can't have QM_CONCURRENT "
+			"or QM_LOCKFREE\n");
+	CBUG((flags & QM_COUNTER) && (vtype != QM_U64
+				|| sizeof(void *) < sizeof(uint64_t)),
+			"QM_COUNTER maps need QM_U64 values, "
+			"and 64-bit pointers\n");
+	CBUG((flags & QM_BORROW) && ((flags & QM_AINDEX)
+				|| ktype == QM_PTR || vtype == QM_PTR),
+			"QM_BORROW maps can't have QM_AINDEX "
+			"or QM_PTR keys or values\n");
+
+	if (flags & QM_CONCURRENT)
+		return qmap_sopen(ktype, vtype, mask, flags);
+
+	hd = qmap_hd_new(flags & QM_MIRROR);
+	_qmap_open(hd, ktype, vtype, mask, flags);
+
+	if (!(flags & QM_MIRROR))
+		return hd;
+
+	flags &= ~QM_AINDEX;
+	_qmap_open(hd + 1, vtype, ktype, mask, flags | QM_PGET);
+	qmap_assoc(hd + 1, hd, NULL);
+
+	return hd;
+}
+
+/* Where each array of a file map of size m starts (see
+ * qmap_fhdr_t), and where the chunks for keys and values
+ * can start.
+ */
+static uint64_t
+qmap_flayout(unsigned m, uint64_t offs[QM_FILE_ARRAYS])
+{
+	uint64_t off = sizeof(qmap_fhdr_t);
+
+	offs[0] = off; // slots
+	off += (uint64_t) m * sizeof(qmap_slot_t);
+	offs[1] = off; // keys
+	off += (uint64_t) m * sizeof(void *);
+	offs[2] = off; // values
+	off += (uint64_t) m * sizeof(void *);
+	offs[3] = off; // hashes
+	off += (uint64_t) m * sizeof(unsigned);
+	offs[4] = off; // control bytes
+	off += m + QM_GROUP;
+
+	return (off + 63) & ~63ull;
+}
+
+/* Keep the ids of a file map in its header, for the next
+ * qmap_fopen. Free positions have no hash, so they are
+ * chained through theirs, in the order of the stack.
+ */
+static void
+qmap_fsave(qmap_t *qmap)
+{
+	qmap_fhdr_t *hdr = qmap->fhdr;
+	ids_t *ids = &qmap->idm.free;
+	unsigned i;
+
+	for (i = 0; i + 1 < ids->n; i++)
+		qmap->ohash[ids->data[i]] = ids->data[i + 1];
+
+	hdr->count = qmap->count;
+	hdr->last = qmap->idm.last;
+	hdr->nfree = ids->n;
+	hdr->ffree = ids->n ? ids->data[0] : QM_MISS;
+	hdr->clean = 1;
+}
+
+/* Get back the ids qmap_fsave kept.
+ *
+ * @returns	0 if it wasn't closed, or they don't add up.
+ */
+static int
+qmap_fload(qmap_t *qmap)
+{
+	qmap_fhdr_t *hdr = qmap->fhdr;
+	unsigned i, n = hdr->ffree;
+
+	if (!hdr->clean || hdr->last > qmap->m
+			|| hdr->nfree > hdr->last
+			|| hdr->count != hdr->last - hdr->nfree)
+		return 0;
+
+	for (i = 0; i < hdr->nfree; i++) {
+		if (n >= hdr->last || qmap->omap[n])
+			break;
+
+		ids_push(&qmap->idm.free, n);
+		n = qmap->ohash[n];
+	}
+
+	// a short or looping chain
+	if (qmap->idm.free.n != hdr->nfree) {
+		ids_drop(&qmap->idm.free);
+		return 0;
+	}
+
+	qmap->idm.last = hdr->last;
+	qmap->count = hdr->count;
+	return 1;
+}
+
+unsigned /* API */
+qmap_fopen(const char *path, unsigned ktype, unsigned vtype,
+		unsigned mask, unsigned flags)
+{
+	uint64_t offs[QM_FILE_ARRAYS] = { 0 }, start = 0, cap;
+	qmap_fhdr_t *hdr;
+	struct stat st;
+	unsigned hd, m = 0, n;
+	qmap_t *qmap;
+	char *base;
+	int fd;
+
+	CBUG(flags & ~QM_AINDEX,
+			"File maps can only have QM_AINDEX\n");
+	CBUG(ktype == QM_PTR || vtype == QM_PTR
+			|| ktype == QM_ISTR || vtype == QM_ISTR,
+			"File maps can't have QM_PTR or QM_ISTR "
+			"keys or values\n");
+
+	fd = open(path, O_RDWR | O_CREAT, 0644);
+	if (fd < 0) {
+		WARN("Can't open %s\n", path);
+		return QM_MISS;
+	}
+
+	// so that the file can grow in place
+	base = mmap(NULL, QM_FILE_MAX, PROT_NONE, MAP_PRIVATE
+			| MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+	CBUG(base == MAP_FAILED, "mmap error\n");
+	hdr = (qmap_fhdr_t *) base;
+
+	if (fstat(fd, &st))
+		goto bad;
+
+	if (!st.st_size) {
+		m = (mask ? mask : QM_DEFAULT_MASK) + 1u;
+		CBUG((m & (m - 1)) != 0, "mask must be 2^k - 1\n");
+		start = qmap_flayout(m, offs);
+		cap = (start + QM_FILE_ALIGN - 1)
+			& ~(uint64_t) (QM_FILE_ALIGN - 1);
+		if (ftruncate(fd, cap))
+			goto bad;
+	} else
+		cap = st.st_size;
+
+	if (cap < sizeof(qmap_fhdr_t) || cap > QM_FILE_MAX
+			|| mmap(base, cap, PROT_READ | PROT_WRITE,
+				MAP_SHARED | MAP_FIXED, fd, 0)
+			== MAP_FAILED)
+		goto bad;
+
+	if (!st.st_size) {
+		// ftruncate zeroed the rest
+		memcpy(hdr->magic, QM_FILE_MAGIC,
+				sizeof(hdr->magic));
+		hdr->version = QM_FILE_VERSION;
+		hdr->types[QM_KEY] = ktype;
+		hdr->types[QM_VALUE] = vtype;
+		hdr->lens[QM_KEY] = qmap_types[ktype].len;
+		hdr->lens[QM_VALUE] = qmap_types[vtype].len;
+		hdr->m = m;
+		hdr->group = QM_GROUP;
+		hdr->end = start;
+		hdr->cap = cap;
+		memset(base + offs[0], 0xFF,
+				m * sizeof(qmap_slot_t));
+		memset(base + offs[4], QM_EMPTY, m + QM_GROUP);
+	} else if (memcmp(hdr->magic, QM_FILE_MAGIC,
+				sizeof(hdr->magic))
+			|| hdr->version != QM_FILE_VERSION
+			|| hdr->types[QM_KEY] != ktype
+			|| hdr->types[QM_VALUE] != vtype
+			|| hdr->lens[QM_KEY] != qmap_types[ktype].len
+			|| hdr->lens[QM_VALUE]
+			!= qmap_types[vtype].len
+			|| hdr->group != QM_GROUP
+			|| hdr->m < 2 || (hdr->m & (hdr->m - 1))
+			|| hdr->cap != cap
+			|| hdr->end > cap)
+		goto bad;
+
+	m = hdr->m;
+	if (qmap_flayout(m, offs) > hdr->end)
+		goto bad;
+
+	hd = _qmap_open(qmap_hd_new(0), ktype, vtype, 1, flags);
+	qmap = qmap_at(hd);
+
+	qmap_idx_free(&qmap->map);
+	free(qmap->omap);
+	free(qmap->table);
+	free(qmap->ohash);
+
+	// not in the file, so we measure instead
+	free(qmap->lens[QM_KEY]);
+	free(qmap->lens[QM_VALUE]);
+	qmap->lens[QM_KEY] = qmap->lens[QM_VALUE] = NULL;
+
+	qmap->map.slots = (qmap_slot_t *) (base + offs[0]);
+	qmap->map.ctrl = (unsigned char *) (base + offs[4]);
+	qmap->map.mask = m - 1;
+	qmap->omap = (const void **) (base + offs[1]);
+	qmap->table = (void **) (base + offs[2]);
+	qmap->ohash = (unsigned *) (base + offs[3]);
+	qmap->m = m;
+	qmap->base = base;
+	qmap->fhdr = hdr;
+	qmap->fd = fd;
+
+	// not closed (a crash?): look for the ids in use
+	if (st.st_size && !qmap_fload(qmap))
+		for (n = 0; n < m; n++)
+			if (qmap->omap[n]) {
+				idm_push(&qmap->idm, n);
+				qmap->count++;
+			}
+
+	// until qmap_fsave says otherwise
+	hdr->clean = 0;
+	return hd;
+
+bad:
+	munmap(base, QM_FILE_MAX);
+	close(fd);
+	WARN("Not a qmap file: %s\n", path);
+	return QM_MISS;
+}
+
+static size_t
+s_measure(const void *key)
+{
+	return strlen(key) + 1;
+}
+
+__attribute__((destructor))
+static void qmap_destruct(void) {
+	for (unsigned i = 0; i < idm.last; i++)
+		qmap_close(i);
+
+	qmap_cur_free(NULL);
+	idm_drop(&idm);
+	for (unsigned c = 0; c < QM_CHUNKS && qmaps[c]; c++)
+		munmap(qmaps[c], QM_CHUNK * sizeof(qmap_t));
+
+	// strings still interned by whoever didn't let go
+	for (unsigned n = 0; n < qmap_pool.idm.last; n++)
+		free(qmap_pool.entries[n]);
+
+	free(qmap_pool.entries);
+	qmap_idx_free(&qmap_pool.idx);
+	idm_drop(&qmap_pool.idm);
+}
+
+__attribute__((constructor))
+static void
+qmap_init(void)
+{
+	qmap_type_t *type;
+
+	qmap_chunk(0);
+	idm = idm_init();
+	reader_idm = idm_init();
+	pthread_key_create(&reader_key, qmap_rfree);
+	pthread_key_create(&cursor_key, qmap_cur_free);
+
+#if !defined(__SSE4_2__)
+	qmap_crc32c_init();
+#endif
+
+	// QM_PTR
+	type = &qmap_types[qmap_reg(sizeof(void *))];
+
+	// QM_HNDL
+	type = &qmap_types[qmap_reg(sizeof(unsigned))];
+	type->hash = qmap_hash_ident;
+	type->cmp = qmap_ucmp;
+
+	// QM_STR
+	qmap_mreg(s_measure);
+
+	// QM_ISTR
+	type = &qmap_types[qmap_mreg(qmap_istr_measure)];
+	type->hash = qmap_istr_hash;
+	type->cmp = qmap_istr_cmp;
+
+	// QM_U64
+	type = &qmap_types[qmap_reg(sizeof(uint64_t))];
+	type->hash = qmap_hash_mix;
+	type->cmp = qmap_u64cmp;
+}
+
+/* }}} */
+
+/* GROW {{{ */
+
+/* Move up to "steps" ids from gmap into map. We only
+ * ever take from gmap, so shifting back never brings
+ * anything into ids we already went past (save for the
+ * ones we are still emptying). Frees gmap when done.
+ */
+static void
+qmap_migrate(unsigned hd, unsigned steps)
+{
+	qmap_t *qmap = qmap_at(hd);
+	for (; qmap->gmap.slots && steps; steps--) {
+		unsigned id = qmap->gpos;
+		qmap_slot_t slot;
+
+		if (id > qmap->gmap.mask) {
+			qmap_idx_retire(qmap, &qmap->gmap);
+			break;
+		}
+
+		slot = qmap->gmap.slots[id];
+		if (slot.n == QM_MISS) {
+			qmap->gpos++;
+			continue;
+		}
+
+		qmap_shift(&qmap->gmap, id);
+		qmap_place(&qmap->map, slot.hash, slot.n);
+	}
+}
+
+/* Double the size of a map. Positions stay where they
+ * are, so we only need to make room for more of them.
+ * Ids are rehashed a few at a time by qmap_migrate.
+ * Secondaries share positions, so they grow with us.
+ */
+static void
+qmap_grow(unsigned hd)
+{
+	qmap_t *qmap = qmap_at(hd);
+	unsigned len = qmap->m << 1, ahd, mbr;
+	idsi_t *cur;
+
+	CBUG(!len, "Capacity reached\n");
+	qmap_migrate(hd, UINT_MAX);
+
+	DEBUG(1, "%u 0x%x\n", hd, len - 1);
+
+	qmap->gmap = qmap->map;
+	qmap->gpos = 0;
+
+	qmap_idx_init(&qmap->map, len);
+	qmap->omap = qmap_realloc(qmap, qmap->omap,
+			qmap->m * sizeof(void *),
+			len * sizeof(void *));
+	qmap->ohash = qmap_realloc(qmap, qmap->ohash,
+			qmap->m * sizeof(unsigned),
+			len * sizeof(unsigned));
+	memset(qmap->omap + qmap->m, 0, qmap->m * sizeof(void *));
+
+	for (mbr = QM_KEY; mbr <= QM_VALUE; mbr++)
+		if (qmap->lens[mbr])
+			qmap->lens[mbr] = qmap_realloc(qmap,
+					qmap->lens[mbr],
+					qmap->m * sizeof(unsigned),
+					len * sizeof(unsigned));
+
+	if (qmap->phd == hd) {
+		qmap->table = qmap_realloc(qmap, qmap->table,
+				qmap->m * sizeof(void *),
+				len * sizeof(void *));
+		memset(qmap->table + qmap->m, 0,
+				qmap->m * sizeof(void *));
+	}
+
+	// readers load m first, so they see arrays this big
+	__atomic_store_n(&qmap->m, len, __ATOMIC_RELEASE);
+
+	cur = ids_iter(&qmap->linked);
+	while (ids_next(&ahd, &cur))
+		while (qmap_at(ahd)->m < len)
+			qmap_grow(ahd);
+}
+
+/* }}} */
+
+/* PUT {{{ */
+
+static void qmap_ndel_topdown(unsigned hd, unsigned n);
+static void qmap_log(qmap_t *qmap, const void *key,
+		size_t klen, const void *value, size_t vlen);
+static void qmap_log_at(qmap_t *qmap, unsigned n,
+		const void *key, size_t klen,
+		const void *value, size_t vlen);
+
+/* This is the low-level put. It doesn't aim to provide
+ * MIRROR functionality in itself, just putting in whatever
+ * kind of map. Keys come already hashed (see qmap_hash),
+ * and values measured (only primaries look at vlen).
+ */
+static inline unsigned
+_qmap_put(unsigned hd, const void * key, size_t klen,
+		unsigned hash, const void *value, size_t vlen,
+		unsigned pn)
+{
+	qmap_t *qmap = qmap_at(hd);
+	unsigned n, id = QM_MISS, old_n = QM_MISS;
+	void *rval, *rkey;
+
+	qmap_migrate(hd, QM_GROW_STEP);
+
+	if (key) {
+		id = qmap_probe(hd, &qmap->map,
+				key, klen, hash, qmap->m);
+
+		if (id != QM_MISS)
+			old_n = qmap->map.slots[id].n;
+		else if (qmap->gmap.slots) {
+			// not moved yet? move it now
+			id = qmap_probe(hd, &qmap->gmap,
+					key, klen, hash, qmap->m);
+
+			if (id != QM_MISS) {
+				old_n = qmap->gmap.slots[id].n;
+				qmap_shift(&qmap->gmap, id);
+				id = qmap_place(&qmap->map,
+						hash, old_n);
+			}
+		}
+	}
+
+	if (old_n == QM_MISS && (qmap->flags & QM_GROW)
+			&& qmap->count >= qmap->m
+			- (qmap->m >> 2))
+		qmap_grow(hd);
+
+	if (old_n != QM_MISS)
+		n = old_n;
+	else if (pn != QM_MISS) {
+		idm_push(&qmap->idm, pn);
+		n = pn;
+	} else
+		n = idm_new(&qmap->idm);
+
+	CBUG(n >= qmap->m, "Capacity reached\n");
+
+	if (!key) {
+		// the key is the position itself
+		key = &n;
+		hash = qmap_hash(hd, key, &klen);
+	}
+
+	if (old_n == QM_MISS) {
+		id = qmap_place(&qmap->map, hash, n);
+		qmap->ohash[n] = hash;
+		qmap->count++;
+	}
+
+	DEBUG(2, "%u %u %u %p\n", hd, n, id, key);
+	rkey = (void *) key;
+
+	if (qmap->phd == hd) {
+		const void *ekey = NULL, *eval = NULL;
+		size_t eklen = 0, evlen = 0;
+
+		if (qmap->types[QM_VALUE] == QM_PTR)
+			value = &value;
+
+		if (old_n != QM_MISS) {
+			idsi_t *cur = ids_iter(&qmap->linked);
+			unsigned ahd;
+
+			// secondaries still point to these
+			while (ids_next(&ahd, &cur))
+				qmap_ndel_topdown(ahd, n);
+
+			ekey = qmap_key(hd, n);
+			eklen = qmap_nlen(qmap, QM_KEY, n, ekey);
+			if (!(qmap->flags & QM_COUNTER)) {
+				eval = qmap_val(hd, n);
+				evlen = qmap_nlen(qmap, QM_VALUE,
+						n, eval);
+			}
+		}
+
+		if (qmap->flags & QM_COUNTER) {
+			uint64_t count = 0;
+
+			// no value: it starts at 0
+			if (value)
+				memcpy(&count, value, sizeof(count));
+			__atomic_store_n((uint64_t *) VAL_ADDR(qmap, n),
+					count, __ATOMIC_RELAXED);
+		} else {
+			rval = qmap_scopy(qmap, QM_VALUE, value, vlen);
+			* VAL_ADDR(qmap, n) = qmap_off(qmap, rval);
+			qmap_nlen_set(qmap, QM_VALUE, n, vlen);
+		}
+
+		// this could be avoided
+		// if the key is the same
+		rkey = qmap_scopy(qmap, QM_KEY, key, klen);
+
+		// only now: with QM_ISTR, the old ones might be
+		// the new ones, and we had the last reference
+		if (old_n != QM_MISS) {
+			qmap_retire(qmap, QM_KEY, ekey, eklen);
+			if (eval)
+				qmap_retire(qmap, QM_VALUE, eval, evlen);
+		}
+	}
+
+	qmap_nlen_set(qmap, QM_KEY, n, klen);
+	qmap->omap[n] = qmap_off(qmap, rkey);
+
+	if (old_n == QM_MISS && (qmap->flags & QM_SORTED))
+		qmap_bt_put(hd, n);
+
+	return id;
+}
+
+/* How long a value we were given is */
+static inline size_t
+qmap_vlen(qmap_t *qmap, const void *value)
+{
+	unsigned type = qmap->types[QM_VALUE];
+
+	// those are stored as the pointer itself
+	return value || type == QM_PTR
+		? qmap_len(type, value) : 0;
+}
+
+/* Put primary positions into a secondary */
+static inline void
+qmap_link_put(unsigned ahd, unsigned hd,
+		const unsigned *ns, unsigned num)
+{
+	qmap_t *aqmap = qmap_at(ahd);
+	const void *skeys[QM_BATCH], *rval;
+	unsigned hashes[QM_BATCH], i;
+	size_t lens[QM_BATCH];
+
+	QM_COUNT(aqmap, QM_C_LINKS, num);
+
+	for (i = 0; i < num; i++) {
+		aqmap->assoc(&skeys[i], qmap_key(hd, ns[i]),
+				qmap_val(hd, ns[i]));
+		hashes[i] = qmap_hash(ahd, skeys[i], &lens[i]);
+		qmap_prefetch(ahd, hashes[i]);
+	}
+
+	for (i = 0; i < num; i++) {
+		rval = qmap_val(hd, ns[i]);
+		_qmap_put(ahd, skeys[i], lens[i], hashes[i],
+				rval, 0, ns[i]);
+	}
+}
+
+/* What QM_COUNTER keys put with no value count from */
+static const uint64_t qmap_zero;
+
+/* qmap_putl, at position pn if the key is new (see
+ * _qmap_put), or wherever there is room if QM_MISS.
+ */
+static unsigned
+_qmap_putl(unsigned hd, const void * const key, size_t klen,
+		const void *value, size_t vlen, unsigned pn)
+{
+	QM_TSTART(t);
+	unsigned ahd, n, id, hash = 0;
+	qmap_t *wqmap;
+	idsi_t *cur;
+
+	if (key)
+		hash = qmap_hashl(hd, key, klen);
+
+	if (qmap_at(hd)->types[QM_VALUE] == QM_PTR)
+		vlen = sizeof(void *);
+
+	// journaled as a 0, not as a delete
+	if (!value && (qmap_at(hd)->flags & QM_COUNTER)) {
+		value = &qmap_zero;
+		vlen = sizeof(qmap_zero);
+	}
+
+	if (qmap_at(hd)->shards) {
+		qmap_shard_t *shard = qmap_shard(hd, hash);
+
+		CBUG(!key, "QM_CONCURRENT needs keys\n");
+		pthread_mutex_lock(&shard->lock);
+		id = _qmap_put(shard->hd, key, klen, hash,
+				value, vlen, QM_MISS);
+		qmap_log(qmap_at(hd), key, klen, value, vlen);
+		pthread_mutex_unlock(&shard->lock);
+		QM_TEND(qmap_at(hd), QM_OP_PUT, t);
+		return id;
+	}
+
+	wqmap = qmap_wbegin(hd);
+	id = _qmap_put(hd, key, klen, hash, value, vlen, pn);
+	n = qmap_at(hd)->map.slots[id].n;
+	if (key)
+		qmap_log_at(qmap_at(hd), n, key, klen, value, vlen);
+	else
+		qmap_log_at(qmap_at(hd), n, &n, qmap_len(
+					qmap_at(hd)->types[QM_KEY], &n),
+				value, vlen);
+
+	cur = ids_iter(&qmap_at(hd)->linked);
+	while (ids_next(&ahd, &cur))
+		qmap_link_put(ahd, hd, &n, 1);
+
+	qmap_wend(wqmap);
+	QM_TEND(qmap_at(hd), QM_OP_PUT, t);
+
+	// with no key, the position is the key
+	return key ? id : n;
+}
+
+unsigned /* API */
+qmap_putl(unsigned hd, const void * const key, size_t klen,
+		const void * const value, size_t vlen)
+{
+	return _qmap_putl(hd, key, klen, value, vlen, QM_MISS);
+}
+
+unsigned /* API */
+qmap_put(unsigned hd, const void * const key,
+		const void * const value)
+{
+	qmap_t *qmap = qmap_at(hd);
+
+	return qmap_putl(hd, key, key
+			? qmap_len(qmap->types[QM_KEY], key) : 0,
+			value, qmap_vlen(qmap, value));
+}
+
+void /* API */
+qmap_put_many(unsigned hd, const void * const *keys,
+		const void * const *values, unsigned *ids,
+		unsigned num)
+{
+	unsigned hashes[QM_BATCH], ns[QM_BATCH];
+	size_t lens[QM_BATCH];
+	unsigned i, j, ahd, id;
+	qmap_t *wqmap;
+	idsi_t *cur;
+
+	if (qmap_at(hd)->shards) {
+		for (i = 0; i < num; i++) {
+			id = qmap_put(hd, keys[i], values[i]);
+			if (ids)
+				ids[i] = id;
+		}
+		return;
+	}
+
+	wqmap = qmap_wbegin(hd);
+
+	for (j = 0; j < num; j += QM_BATCH,
+			keys += QM_BATCH, values += QM_BATCH)
+	{
+		unsigned bn = num - j < QM_BATCH
+			? num - j : QM_BATCH;
+
+		for (i = 0; i < bn; i++) {
+			if (!keys[i])
+				continue;
+
+			hashes[i] = qmap_hash(hd, keys[i], &lens[i]);
+			qmap_prefetch(hd, hashes[i]);
+		}
+
+		for (i = 0; i < bn; i++) {
+			const void *value = values[i];
+			size_t vlen;
+
+			// as in _qmap_putl
+			if (!value && (qmap_at(hd)->flags & QM_COUNTER))
+				value = &qmap_zero;
+
+			vlen = qmap_vlen(qmap_at(hd), value);
+			id = _qmap_put(hd, keys[i],
+					keys[i] ? lens[i] : 0,
+					keys[i] ? hashes[i] : 0,
+					value, vlen, QM_MISS);
+
+			ns[i] = qmap_at(hd)->map.slots[id].n;
+			if (keys[i])
+				qmap_log_at(qmap_at(hd), ns[i], keys[i],
+						lens[i], value, vlen);
+			else
+				qmap_log_at(qmap_at(hd), ns[i], &ns[i],
+						qmap_len(qmap_at(hd)
+							->types[QM_KEY],
+							&ns[i]), value, vlen);
+			if (ids)
+				ids[j + i] = keys[i] ? id : ns[i];
+		}
+
+		// once per batch, not once per put
+		cur = ids_iter(&qmap_at(hd)->linked);
+		while (ids_next(&ahd, &cur))
+			qmap_link_put(ahd, hd, ns, bn);
+	}
+
+	qmap_wend(wqmap);
+}
+
+/* Whether the key a secondary derives from a value is
+ * not what it derived from the old one (ovalue). Keys
+ * from assoc may be in a buffer of its own, so we copy
+ * the old one before getting the new.
+ */
+static int
+qmap_skey_changed(unsigned ahd, const void *key,
+		const void *ovalue, const void *value)
+{
+	qmap_t *aqmap = qmap_at(ahd);
+	unsigned type = aqmap->types[QM_KEY];
+	const void *skey;
+	char sbuf[QM_UPSERT_BUF], *ocopy = sbuf;
+	size_t olen, len;
+	int ret;
+
+	aqmap->assoc(&skey, key, ovalue);
+	olen = qmap_len(type, skey);
+	if (olen > sizeof(sbuf)) {
+		ocopy = malloc(olen);
+		CBUG(!ocopy, "malloc error\n");
+	}
+	memcpy(ocopy, skey, olen);
+
+	aqmap->assoc(&skey, key, value);
+	len = qmap_len(type, skey);
+	ret = len != olen || memcmp(skey, ocopy, len);
+
+	if (ocopy != sbuf)
+		free(ocopy);
+	return ret;
+}
+
+/* Call cb on the value at n, then fix the secondaries
+ * whose keys it changed. Those have to find the entry
+ * by its old key to take it out, so it gets the old
+ * value back for that.
+ */
+static void
+qmap_nupdate(unsigned hd, unsigned n, size_t vlen,
+		qmap_upsert_t *cb, void *ctx)
+{
+	qmap_t *qmap = qmap_at(hd);
+	void *value = qmap_val(hd, n);
+	const void *key = qmap_key(hd, n);
+	char vbuf[2 * QM_UPSERT_BUF], *old = vbuf, *new;
+	unsigned ahd;
+	idsi_t *cur;
+
+	if (!qmap->linked.n) {
+		cb(value, 1, ctx);
+		return;
+	}
+
+	if (2 * vlen > sizeof(vbuf)) {
+		old = malloc(2 * vlen);
+		CBUG(!old, "malloc error\n");
+	}
+	new = old + vlen;
+
+	memcpy(old, value, vlen);
+	cb(value, 1, ctx);
+
+	cur = ids_iter(&qmap->linked);
+	while (ids_next(&ahd, &cur)) {
+		if (!qmap_skey_changed(ahd, key, old, value))
+			continue;
+
+		memcpy(new, value, vlen);
+		memcpy(value, old, vlen);
+		qmap_ndel_topdown(ahd, n);
+		memcpy(value, new, vlen);
+		qmap_link_put(ahd, hd, &n, 1);
+	}
+
+	if (old != vbuf)
+		free(old);
+}
+
+/* Upsert into a map with no shards, or into a shard */
+static void *
+_qmap_upsert(unsigned hd, const void * const key, size_t klen,
+		unsigned hash, size_t vlen, qmap_upsert_t *cb,
+		void *ctx)
+{
+	char zbuf[QM_UPSERT_BUF], *zero = zbuf;
+	unsigned n = qmap_lookup(hd, key, klen, hash), id, ahd;
+	void *value;
+	idsi_t *cur;
+
+	if (n != QM_MISS) {
+		qmap_nupdate(hd, n, vlen, cb, ctx);
+		return qmap_val(hd, n);
+	}
+
+	if (vlen > sizeof(zbuf)) {
+		zero = calloc(1, vlen);
+		CBUG(!zero, "malloc error\n");
+	} else
+		memset(zbuf, 0, vlen);
+
+	// those are stored as the pointer itself
+	if (qmap_at(hd)->types[QM_VALUE] == QM_PTR)
+		zero = NULL;
+
+	id = _qmap_put(hd, key, klen, hash, zero, vlen, QM_MISS);
+	n = qmap_at(hd)->map.slots[id].n;
+	value = qmap_val(hd, n);
+	cb(value, 0, ctx);
+
+	// now that it has its value
+	cur = ids_iter(&qmap_at(hd)->linked);
+	while (ids_next(&ahd, &cur))
+		qmap_link_put(ahd, hd, &n, 1);
+
+	if (zero && zero != zbuf)
+		free(zero);
+	return value;
+}
+
+void * /* API */
+qmap_upsert(unsigned hd, const void * const key,
+		qmap_upsert_t *cb, void *ctx)
+{
+	QM_TSTART(t);
+	qmap_t *qmap = qmap_at(hd);
+	qmap_type_t *vtype = &qmap_types[qmap->types[QM_VALUE]];
+	size_t klen;
+	unsigned hash = qmap_hash(hd, key, &klen);
+	void *value;
+
+	CBUG(qmap->phd != hd, "Upsert the primary instead\n");
+	CBUG(vtype->measure, "Upserts need fixed length values\n");
+	CBUG(qmap->flags & (QM_LOCKFREE | QM_BORROW),
+			"Can't upsert QM_LOCKFREE or QM_BORROW maps\n");
+
+	if (qmap->shards) {
+		qmap_shard_t *shard = qmap_shard(hd, hash);
+
+		pthread_mutex_lock(&shard->lock);
+		value = _qmap_upsert(shard->hd, key, klen, hash,
+				vtype->len, cb, ctx);
+		qmap_log(qmap, key, klen, value, vtype->len);
+		pthread_mutex_unlock(&shard->lock);
+	} else {
+		value = _qmap_upsert(hd, key, klen, hash,
+				vtype->len, cb, ctx);
+		qmap_log(qmap, key, klen, value, vtype->len);
+	}
+
+	QM_TEND(qmap, QM_OP_PUT, t);
+	return value;
+}
+
+typedef struct {
+	int64_t delta;
+	uint64_t count;
+} qmap_incr_t;
+
+/* qmap_incr, as an upsert */
+static void
+qmap_add(void *value, int found UNUSED, void *ctx)
+{
+	qmap_incr_t *incr = ctx;
+
+	// qmap_incr_atomic may be adding too
+	incr->count = __atomic_add_fetch((uint64_t *) value,
+			incr->delta, __ATOMIC_RELAXED);
+}
+
+uint64_t /* API */
+qmap_incr(unsigned hd, const void * const key, int64_t delta)
+{
+	QM_TSTART(t);
+	qmap_t *qmap = qmap_at(hd), *wqmap;
+	qmap_incr_t incr = { .delta = delta };
+	size_t klen;
+	unsigned hash = qmap_hash(hd, key, &klen);
+	void *value;
+
+	CBUG(!(qmap->flags & QM_COUNTER), "Not a counter map\n");
+	CBUG(qmap->phd != hd, "Count in the primary instead\n");
+	// qmap_nupdate would put the old count back for
+	// a while, in place, for readers to see
+	CBUG((qmap->flags & QM_LOCKFREE) && qmap->linked.n,
+			"QM_LOCKFREE counters with secondaries "
+			"can't be incremented\n");
+
+	if (qmap->shards) {
+		qmap_shard_t *shard = qmap_shard(hd, hash);
+
+		pthread_mutex_lock(&shard->lock);
+		value = _qmap_upsert(shard->hd, key, klen, hash,
+				sizeof(uint64_t), qmap_add, &incr);
+		qmap_log(qmap, key, klen, value, sizeof(uint64_t));
+		pthread_mutex_unlock(&shard->lock);
+	} else {
+		// an add can't be seen halfway, so readers of
+		// QM_LOCKFREE maps (with no secondaries) are
+		// fine with it in place
+		wqmap = qmap_wbegin(hd);
+		value = _qmap_upsert(hd, key, klen, hash,
+				sizeof(uint64_t), qmap_add, &incr);
+		qmap_log(qmap, key, klen, value, sizeof(uint64_t));
+		qmap_wend(wqmap);
+	}
+
+	QM_TEND(qmap, QM_OP_PUT, t);
+	return incr.count;
+}
+
+uint64_t /* API */
+qmap_incr_atomic(unsigned hd, const void * const key,
+		int64_t delta)
+{
+	QM_TSTART(t);
+	qmap_t *qmap = qmap_at(hd);
+	const void *value;
+	uint64_t ret;
+	unsigned hash;
+	size_t len;
+
+	// the table can't move, nor anyone hear of adds
+	CBUG((qmap->flags & (QM_COUNTER | QM_LOCKFREE | QM_GROW))
+			!= (QM_COUNTER | QM_LOCKFREE)
+			|| qmap->linked.n || qmap->wal,
+			"Atomic increments need QM_COUNTER and "
+			"QM_LOCKFREE, without QM_GROW, secondaries "
+			"or a journal\n");
+
+	hash = qmap_hash(hd, key, &len);
+	if (qmap_rlookup(hd, key, len, hash, &value) == QM_MISS)
+		return qmap_incr(hd, key, delta);
+
+	ret = __atomic_add_fetch((uint64_t *) value, delta,
+			__ATOMIC_RELAXED);
+	QM_TEND(qmap, QM_OP_PUT, t);
+	return ret;
+}
+
+/* }}} */
+
+/* GET {{{ */
+
+/* Point lookups don't need a cursor. Just probe. */
+const void * /* API */
+qmap_getl(unsigned hd, const void * const key, size_t len)
+{
+	QM_TSTART(t);
+	unsigned hash = qmap_hashl(hd, key, len), n;
+	qmap_shard_t *shard;
+	const void *ret;
+
+	if (qmap_at(hd)->flags & QM_LOCKFREE)
+		qmap_rlookup(hd, key, len, hash, &ret);
+	else if (!qmap_at(hd)->shards) {
+		n = qmap_lookup(hd, key, len, hash);
+		ret = n == QM_MISS ? NULL : qmap_val(hd, n);
+	} else {
+		shard = qmap_shard(hd, hash);
+		pthread_mutex_lock(&shard->lock);
+		n = qmap_lookup(shard->hd, key, len, hash);
+		ret = n == QM_MISS ? NULL : qmap_val(shard->hd, n);
+		pthread_mutex_unlock(&shard->lock);
+	}
+
+	QM_TEND(qmap_at(hd), QM_OP_GET, t);
+	return ret;
+}
+
+const void * /* API */
+qmap_get(unsigned hd, const void * const key)
+{
+	return qmap_getl(hd, key,
+			qmap_len(qmap_at(hd)->types[QM_KEY], key));
+}
+
+void * /* API */
+qmap_get_mut(unsigned hd, const void * const key)
+{
+	qmap_t *qmap = qmap_at(hd);
+
+	CBUG(qmap_at(qmap_root(hd))->flags & QM_LOCKFREE,
+			"QM_LOCKFREE values can't change in place\n");
+	CBUG((qmap->flags & QM_PGET)
+			|| qmap_at(qmap->phd)->types[QM_VALUE] == QM_ISTR,
+			"Only values can change in place\n");
+
+	return (void *) qmap_get(hd, key);
+}
+
+unsigned /* API */
+qmap_get_many(unsigned hd, const void * const *keys,
+		const void **values, unsigned num)
+{
+	qmap_t *qmap = qmap_at(hd), *pqmap = qmap_at(qmap->phd);
+	unsigned hashes[QM_BATCH], i, j, n, found = 0;
+	size_t lens[QM_BATCH];
+
+	if (qmap->shards || (qmap->flags & QM_LOCKFREE)) {
+		for (i = 0; i < num; i++)
+			found += !!(values[i] = qmap_get(hd, keys[i]));
+		return found;
+	}
+
+	for (j = 0; j < num; j += QM_BATCH,
+			keys += QM_BATCH, values += QM_BATCH)
+	{
+		unsigned bn = num - j < QM_BATCH
+			? num - j : QM_BATCH;
+
+		for (i = 0; i < bn; i++) {
+			hashes[i] = qmap_hash(hd, keys[i], &lens[i]);
+			qmap_prefetch(hd, hashes[i]);
+		}
+
+		// the likely position of each key
+		for (i = 0; i < bn; i++) {
+			qmap_idx_t *idx = &qmap->map;
+			unsigned home = hashes[i] & idx->mask, empty;
+			unsigned match = qmap_group(idx->ctrl + home,
+					QM_H7(hashes[i]), &empty);
+
+			if (!match)
+				continue;
+
+			n = idx->slots[(home + __builtin_ctz(match))
+				& idx->mask].n;
+			__builtin_prefetch(qmap->omap + n);
+			__builtin_prefetch(VAL_ADDR(pqmap, n));
+		}
+
+		for (i = 0; i < bn; i++) {
+			n = qmap_lookup(hd, keys[i],
+					lens[i], hashes[i]);
+
+			if (n == QM_MISS) {
+				values[i] = NULL;
+				continue;
+			}
+
+			values[i] = qmap_val(hd, n);
+			found++;
+		}
+	}
+
+	return found;
+}
+
+/* }}} */
+
+/* DELETE {{{ */
+
+static void qmap_ndel_topdown(unsigned hd, unsigned n){
+	qmap_t *qmap = qmap_at(hd);
+	const void *key, *value;
+	unsigned ahd;
+	idsi_t *cur;
+
+	if (n >= qmap->m)
+		return;
+
+	qmap_migrate(hd, QM_GROW_STEP);
+	cur = ids_iter(&qmap->linked);
+
+	while (ids_next(&ahd, &cur))
+		qmap_ndel_topdown(ahd, n);
+
+	key = qmap_key(hd, n);
+	if (!key)
+		return;
+
+	qmap_unslot(hd, n);
+	qmap_bt_del(hd, n, key);
+
+	if (qmap->phd == hd) {
+		value = qmap_val(hd, n);
+		qmap_retire(qmap, QM_KEY, key,
+				qmap_nlen(qmap, QM_KEY, n, key));
+		if (!(qmap->flags & QM_COUNTER))
+			qmap_retire(qmap, QM_VALUE, value,
+					qmap_nlen(qmap, QM_VALUE,
+						n, value));
+	} else
+		QM_COUNT(qmap, QM_C_LINKS, 1);
+
+	qmap->omap[n] = NULL;
+	idm_del(&qmap->idm, n);
+
+}
+
+/* Delete based on position */
+static inline void
+qmap_ndel(unsigned hd, unsigned n) {
+	qmap_ndel_topdown(qmap_root(hd), n);
+}
 
-	// STORE {{{
-	qmap->table = malloc(sizeof(void *) * len);
-	memset(qmap->table, 0, sizeof(void *) * len);
-	// }}}
+/* Journal the delete of position n of a map. Deletes
+ * through a secondary take out the primary's entry, so
+ * that is what its journal gets, by the primary's key.
+ * Before the delete, while that key is still there.
+ */
+static void
+qmap_log_ndel(unsigned hd, unsigned n)
+{
+	unsigned rhd = qmap_root(hd);
+	qmap_t *rqmap = qmap_at(rhd);
+	const void *key;
+
+	if (!rqmap->wal || !(key = qmap_key(rhd, n)))
+		return;
+
+	qmap_log(rqmap, key, qmap_nlen(rqmap, QM_KEY, n, key),
+			NULL, 0);
+}
+
+void /* API */
+qmap_dell(unsigned hd, const void * const key, size_t len)
+{
+	QM_TSTART(t);
+	unsigned hash = qmap_hashl(hd, key, len), n;
+	qmap_shard_t *shard;
+
+	if (!qmap_at(hd)->shards) {
+		qmap_t *wqmap = qmap_wbegin(hd);
+
+		n = qmap_lookup(hd, key, len, hash);
+		if (n != QM_MISS) {
+			qmap_log_ndel(hd, n);
+			qmap_ndel(hd, n);
+		}
+		qmap_wend(wqmap);
+	} else {
+		shard = qmap_shard(hd, hash);
+		pthread_mutex_lock(&shard->lock);
+		n = qmap_lookup(shard->hd, key, len, hash);
+		if (n != QM_MISS) {
+			qmap_ndel(shard->hd, n);
+			qmap_log(qmap_at(hd), key, len, NULL, 0);
+		}
+		pthread_mutex_unlock(&shard->lock);
+	}
+
+	QM_TEND(qmap_at(hd), QM_OP_DEL, t);
+}
+
+void /* API */
+qmap_del(unsigned hd, const void * const key)
+{
+	qmap_dell(hd, key,
+			qmap_len(qmap_at(hd)->types[QM_KEY], key));
+}
+
+/* }}} */
+
+/* ITERATION {{{ */
+
+/* Where an iteration of a map without shards starts */
+static inline unsigned
+qmap_ipos(unsigned hd, const void * const key,
+		unsigned flags)
+{
+	const void *value;
+	unsigned hash, n;
+	size_t len;
+
+	if (!key || (flags & QM_RANGE))
+		return 0;
+
+	hash = qmap_hash(hd, key, &len);
+	n = qmap_at(hd)->flags & QM_LOCKFREE
+		? qmap_rlookup(hd, key, len, hash, &value)
+		: qmap_lookup(hd, key, len, hash);
+
+	DEBUG(2, "%u %u %p\n", hd, n, key);
+	return n;
+}
+
+void /* API */
+qmap_iter_init(qmap_cur_t *cursor, unsigned hd,
+		const void * const key, unsigned flags)
+{
+	qmap_t *qmap = qmap_at(hd);
+	size_t len;
+
+	cursor->hd = hd;
+	cursor->key = key;
+	cursor->flags = flags;
+	cursor->shard = 0;
+
+	// until the iteration ends (qmap_cur_end)
+	if (qmap->flags & QM_LOCKFREE)
+		qmap_enter();
+
+	if ((qmap->flags & QM_SORTED) && (flags & QM_RANGE)) {
+		// in key order, from the first not before key
+		cursor->node = qmap_bt_seek(hd, key, &cursor->pos);
+	} else if (qmap->shards) {
+		// pos is set once we get to a shard
+		if (key && !(flags & QM_RANGE))
+			cursor->shard = qmap_shard_id(
+					qmap_hash(hd, key, &len));
+		cursor->pos = QM_MISS;
+	} else
+		cursor->pos = qmap_ipos(hd, key, flags);
+
+	cursor->ipos = cursor->pos;
+}
+
+static inline void
+qmap_cur_end(qmap_cur_t *cursor)
+{
+	if (cursor->flags & QM_CUR_END)
+		return;
+
+	cursor->flags |= QM_CUR_END;
+	if (qmap_at(cursor->hd)->flags & QM_LOCKFREE)
+		qmap_leave();
+}
+
+void /* API */
+qmap_cfin(qmap_cur_t *cursor)
+{
+	qmap_cur_end(cursor);
+}
+
+void /* API */
+qmap_fin(unsigned cur_id)
+{
+	qmap_cfin(&qmap_cursors[cur_id]);
+	qmap_cur_del(cur_id);
+}
+
+unsigned /* API */
+qmap_iter(unsigned hd, const void * const key, unsigned flags)
+{
+	unsigned cur_id = qmap_cur_new();
+
+	QM_COUNT(qmap_at(hd), QM_C_CURSORS, 1);
+	qmap_iter_init(&qmap_cursors[cur_id], hd, key, flags);
+	return cur_id;
+}
+
+/* low-level next, walking map hd (one of the shards,
+ * or the cursor's own map).
+ */
+static int
+qmap_lnext(unsigned *sn, qmap_cur_t *cursor, unsigned hd)
+{
+	register qmap_t *qmap = qmap_at(hd);
+	unsigned n;
+	const void *key;
+cagain:
+	n = cursor->pos;
+
+	// a QM_LOCKFREE writer might be growing it
+	if (n >= qmap->idm.last
+			|| n >= __atomic_load_n(&qmap->m,
+				__ATOMIC_ACQUIRE))
+		goto end;
+
+	key = qmap_key(hd, n);
+	if (key == NULL) {
+		cursor->pos++;
+		goto cagain;
+	}
+
+	if (cursor->flags & QM_RANGE) {
+		qmap_type_t *type
+			= &qmap_types[qmap->types[QM_KEY]];
+
+		if (cursor->key && type->cmp(key, cursor->key,
+					type->len) < 0)
+		{
+			cursor->pos++;
+			goto cagain;
+		}
+	} else if (cursor->key && n != cursor->ipos)
+		goto end;
+
+	DEBUG(3, "NEXT! hd %u key %p\n", hd, key);
+
+	cursor->pos++;
+	*sn = n;
+	return 1;
+end:
+	*sn = QM_MISS;
+	return 0;
+}
+
+/* Next of a QM_CONCURRENT map. Goes through the shards
+ * one by one, holding each lock only for a single step.
+ */
+static int
+qmap_snext(const void ** ckey, const void ** cval,
+		qmap_cur_t *c)
+{
+	qmap_t *qmap = qmap_at(c->hd);
+	qmap_shard_t *shard;
+	unsigned sn;
+	int ret;
+
+	while (c->shard < QM_SHARDS) {
+		shard = &qmap->shards[c->shard];
+		if (!(c->flags & QM_CUR_HELD))
+			pthread_mutex_lock(&shard->lock);
+
+		if (c->pos == QM_MISS)
+			c->ipos = c->pos = qmap_ipos(shard->hd,
+					c->key, c->flags);
+
+		ret = qmap_lnext(&sn, c, shard->hd);
+		if (ret) {
+			*ckey = qmap_key(shard->hd, sn);
+			*cval = qmap_val(shard->hd, sn);
+		}
+
+		if (!(c->flags & QM_CUR_HELD))
+			pthread_mutex_unlock(&shard->lock);
+
+		if (ret)
+			return 1;
+
+		if (c->key && !(c->flags & QM_RANGE))
+			break;
+		c->shard++;
+		c->pos = QM_MISS;
+	}
+
+	return 0;
+}
+
+/* Next of a QM_LOCKFREE map. A writer could give the
+ * position to another key while we read it, so we check
+ * that none was at work, like qmap_rlookup.
+ */
+static int
+qmap_rnext(const void ** ckey, const void ** cval,
+		qmap_cur_t *c)
+{
+	qmap_t *rqmap = qmap_at(qmap_root(c->hd));
+	unsigned seq, sn;
+
+	for (;;) {
+		while ((seq = __atomic_load_n(&rqmap->seq,
+						__ATOMIC_ACQUIRE)) & 1)
+			;
+
+		if (!qmap_lnext(&sn, c, c->hd))
+			return 0;
+
+		*ckey = qmap_key(c->hd, sn);
+		*cval = qmap_val(c->hd, sn);
+
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		if (__atomic_load_n(&rqmap->seq,
+					__ATOMIC_RELAXED) == seq)
+			return 1;
+
+		// look at that position again
+		c->pos = sn;
+	}
+}
+
+/* Next of a QM_RANGE iteration of a QM_SORTED map.
+ * That just walks the leaves of the ordered index.
+ */
+static int
+qmap_onext(unsigned *sn, qmap_cur_t *c)
+{
+	qmap_bt_t *leaf = c->node;
+
+	while (leaf && c->pos >= leaf->n) {
+		leaf = leaf->next;
+		c->pos = 0;
+	}
+
+	c->node = leaf;
+	if (!leaf)
+		return 0;
+
+	*sn = leaf->pos[c->pos++];
+	return 1;
+}
+
+int /* API */
+qmap_cnext(const void ** ckey, const void ** cval,
+		qmap_cur_t *c)
+{
+	qmap_t *qmap = qmap_at(c->hd);
+	unsigned sn;
+	int ret;
+
+	if (c->flags & QM_CUR_END)
+		return 0;
+
+	if ((qmap->flags & QM_SORTED) && (c->flags & QM_RANGE)) {
+		if ((ret = qmap_onext(&sn, c))) {
+			*ckey = qmap_key(c->hd, sn);
+			*cval = qmap_val(c->hd, sn);
+		}
+	} else if (qmap->shards)
+		ret = qmap_snext(ckey, cval, c);
+	else if (qmap->flags & QM_LOCKFREE)
+		ret = qmap_rnext(ckey, cval, c);
+	else if ((ret = qmap_lnext(&sn, c, c->hd))) {
+		*ckey = qmap_key(c->hd, sn);
+		*cval = qmap_val(c->hd, sn);
+	}
+
+	if (!ret)
+		qmap_cur_end(c);
+
+	return ret;
+}
+
+int /* API */
+qmap_next(const void ** ckey, const void ** cval,
+		unsigned cur_id)
+{
+	int ret = qmap_cnext(ckey, cval, &qmap_cursors[cur_id]);
+
+	if (!ret)
+		qmap_cur_del(cur_id);
+
+	return ret;
+}
+
+/* }}} */
+
+/* SAVE / LOAD {{{ */
+
+/* What a snapshot starts with. Then come the entries,
+ * each a qmap_rec_t followed by the bytes of its key
+ * and value. All in native byte order. The entries of
+ * QM_AINDEX maps keep their positions, since those are
+ * what keyless puts gave out as keys.
+ */
+typedef struct {
+	char magic[4];
+	uint32_t version;
+	uint32_t types[2], lens[2];
+	uint32_t mask, flags, count;
+} qmap_snap_t;
+
+typedef struct {
+	uint32_t klen, vlen;
+	uint32_t pos;		// or QM_MISS
+} qmap_rec_t;
+
+static int
+qmap_write(int fd, const void *data, size_t len)
+{
+	const char *p = data;
+	ssize_t ret;
+
+	while (len) {
+		ret = write(fd, p, len);
+		if (ret < 0)
+			return -1;
+		p += ret;
+		len -= ret;
+	}
+
+	return 0;
+}
+
+/* Buffer small writes, so we don't do one per entry */
+static int
+qmap_wbuf(int fd, char *buf, size_t *pos,
+		const void *data, size_t len)
+{
+	if (*pos + len > QM_SNAP_BUF) {
+		if (qmap_write(fd, buf, *pos))
+			return -1;
+		*pos = 0;
+	}
+
+	if (len > QM_SNAP_BUF)
+		return qmap_write(fd, data, len);
+
+	memcpy(buf + *pos, data, len);
+	*pos += len;
+	return 0;
+}
+
+/* The position of what a cursor (not QM_RANGE) just
+ * gave us, and the map it is in: shards have their own.
+ */
+static inline unsigned
+qmap_cur_pos(qmap_cur_t *c, unsigned *hd)
+{
+	qmap_t *qmap = qmap_at(c->hd);
+
+	*hd = qmap->shards ? qmap->shards[c->shard].hd : c->hd;
+	return c->pos - 1;
+}
+
+/* qmap_save, iterating with cursor flags cflags */
+static int
+_qmap_save(unsigned hd, int fd, unsigned cflags)
+{
+	qmap_t *qmap = qmap_at(hd);
+	const void *key, *value;
+	qmap_snap_t snap;
+	qmap_rec_t rec;
+	qmap_cur_t cur;
+	size_t pos = 0;
+	unsigned i, shd;
+	char *buf;
+	int ret;
+
+	CBUG(qmap->phd != hd, "Save the primary instead\n");
+	CBUG(qmap->types[QM_KEY] == QM_PTR
+			|| qmap->types[QM_VALUE] == QM_PTR
+			|| qmap->types[QM_KEY] == QM_ISTR
+			|| qmap->types[QM_VALUE] == QM_ISTR,
+			"Can't save pointers\n");
+
+	buf = malloc(QM_SNAP_BUF);
+	CBUG(!buf, "malloc error\n");
+
+	memset(&snap, 0, sizeof(snap));
+	memcpy(snap.magic, QM_SNAP_MAGIC, sizeof(snap.magic));
+	snap.version = QM_SNAP_VERSION;
+	snap.types[QM_KEY] = qmap->types[QM_KEY];
+	snap.types[QM_VALUE] = qmap->types[QM_VALUE];
+	snap.lens[QM_KEY] = qmap_types[snap.types[QM_KEY]].len;
+	snap.lens[QM_VALUE] = qmap_types[snap.types[QM_VALUE]].len;
+	snap.flags = qmap->flags;
+	snap.mask = qmap->m - 1;
+	snap.count = qmap->count;
+
+	if (qmap->shards) {
+		snap.mask = qmap_at(qmap->shards[0].hd)->m
+			* QM_SHARDS - 1;
+		for (i = 0; i < QM_SHARDS; i++)
+			snap.count += qmap_at(qmap->shards[i].hd)->count;
+	}
+
+	ret = qmap_wbuf(fd, buf, &pos, &snap, sizeof(snap));
+
+	qmap_iter_init(&cur, hd, NULL, cflags);
+	while (!ret && qmap_cnext(&key, &value, &cur)) {
+		// the lengths they were put with, not measured
+		rec.pos = qmap_cur_pos(&cur, &shd);
+		rec.klen = qmap_nlen(qmap_at(shd), QM_KEY,
+				rec.pos, key);
+		rec.vlen = qmap_nlen(qmap_at(shd), QM_VALUE,
+				rec.pos, value);
+		if (!(qmap->flags & QM_AINDEX))
+			rec.pos = QM_MISS;
+		ret = qmap_wbuf(fd, buf, &pos, &rec, sizeof(rec))
+			|| qmap_wbuf(fd, buf, &pos, key, rec.klen)
+			|| qmap_wbuf(fd, buf, &pos, value, rec.vlen);
+	}
+
+	qmap_cfin(&cur);
+	ret = ret || qmap_write(fd, buf, pos);
+	free(buf);
+	return ret ? -1 : 0;
+}
+
+int /* API */
+qmap_save(unsigned hd, int fd)
+{
+	return _qmap_save(hd, fd, 0);
+}
+
+/* Read the rest of a file into memory */
+static char *
+qmap_slurp(int fd, size_t *len)
+{
+	size_t cap = QM_SNAP_BUF;
+	char *buf = malloc(cap), *nbuf;
+	ssize_t ret;
+
+	CBUG(!buf, "malloc error\n");
+	*len = 0;
+
+	while ((ret = read(fd, buf + *len, cap - *len)) > 0) {
+		*len += ret;
+		if (*len < cap)
+			continue;
+
+		cap *= 2;
+		nbuf = realloc(buf, cap);
+		CBUG(!nbuf, "malloc error\n");
+		buf = nbuf;
+	}
+
+	if (ret < 0) {
+		free(buf);
+		return NULL;
+	}
+
+	return buf;
+}
+
+/* Whether what a snapshot or journal has fits in hd.
+ * Types of fixed length need their keys and values to
+ * be that long, and a position pn has to be in range,
+ * and free or where the same key already is.
+ */
+static int
+qmap_rec_ok(unsigned hd, const void *key, size_t klen,
+		const void *value, size_t vlen, unsigned pn)
+{
+	qmap_t *qmap = qmap_at(hd);
+	size_t tklen = qmap_types[qmap->types[QM_KEY]].len,
+	       tvlen = qmap_types[qmap->types[QM_VALUE]].len;
+	const void *ekey;
+
+	if ((tklen && klen != tklen)
+			|| (value && tvlen && vlen != tvlen))
+		return 0;
+
+	if (pn == QM_MISS)
+		return 1;
+
+	if (pn >= qmap->m)
+		return 0;
+
+	ekey = qmap_key(hd, pn);
+	return !ekey || (qmap_nlen(qmap, QM_KEY, pn, ekey) == klen
+			&& !memcmp(ekey, key, klen));
+}
+
+unsigned /* API */
+qmap_load(int fd)
+{
+	const void *keys[QM_BATCH], *values[QM_BATCH];
+	unsigned hd, num = 0, mask;
+	qmap_snap_t snap;
+	qmap_rec_t rec;
+	size_t len, pos;
+	char *buf = qmap_slurp(fd, &len);
+
+	if (!buf)
+		return QM_MISS;
+
+	if (len < sizeof(snap))
+		goto bad;
+
+	memcpy(&snap, buf, sizeof(snap));
+	if (memcmp(snap.magic, QM_SNAP_MAGIC, sizeof(snap.magic))
+			|| snap.version != QM_SNAP_VERSION
+			|| snap.types[QM_KEY] >= types_n
+			|| snap.types[QM_VALUE] >= types_n
+			|| snap.lens[QM_KEY]
+			!= qmap_types[snap.types[QM_KEY]].len
+			|| snap.lens[QM_VALUE]
+			!= qmap_types[snap.types[QM_VALUE]].len)
+		goto bad;
+
+	// room for all of them, so we never grow
+	for (mask = snap.mask; snap.count
+			> (mask + 1u) - ((mask + 1u) >> 2);)
+		mask = (mask << 1) | 1;
+
+	// buf goes away, so nothing can be borrowed from it
+	hd = qmap_open(snap.types[QM_KEY], snap.types[QM_VALUE],
+			mask, (snap.flags & ~(QM_PGET | QM_BORROW))
+			| QM_ARENA);
+
+	for (pos = sizeof(snap); pos < len;) {
+		if (len - pos < sizeof(rec))
+			goto badmap;
+
+		memcpy(&rec, buf + pos, sizeof(rec));
+		pos += sizeof(rec);
+		if (len - pos < (size_t) rec.klen + rec.vlen)
+			goto badmap;
+
+		keys[num] = buf + pos;
+		values[num] = buf + pos + rec.klen;
+		pos += rec.klen + rec.vlen;
+
+		if (!(snap.flags & QM_AINDEX))
+			rec.pos = QM_MISS;
+
+		if (!qmap_rec_ok(hd, keys[num], rec.klen,
+					values[num], rec.vlen, rec.pos))
+			goto badmap;
+
+		// one by one, at the positions they had
+		if (rec.pos != QM_MISS) {
+			_qmap_putl(hd, keys[num], rec.klen,
+					values[num], rec.vlen, rec.pos);
+			continue;
+		}
+
+		if (++num < QM_BATCH)
+			continue;
+
+		qmap_put_many(hd, keys, values, NULL, num);
+		num = 0;
+	}
+
+	qmap_put_many(hd, keys, values, NULL, num);
+	free(buf);
+	return hd;
+
+badmap:
+	qmap_close(hd);
+bad:
+	WARN("Not a qmap snapshot\n");
+	free(buf);
+	return QM_MISS;
+}
+
+/* }}} */
+
+/* JOURNAL {{{ */
+
+/* A journal (qmap_journal) starts with this. Then come
+ * records, each a qmap_jrec_t followed by its key and
+ * value bytes. Deletes have no value, and drops neither.
+ * Puts to QM_AINDEX maps say where they went.
+ */
+typedef struct {
+	char magic[4];
+	uint32_t version;
+	uint32_t types[2], lens[2];
+} qmap_jhdr_t;
 
-	memset(qmap->map, 0xFF, ids_len);
-	memset(qmap->omap, 0, sizeof(void *) * len);
+typedef struct {
+	uint32_t klen, vlen;	// or QM_JOURNAL_NONE
+	uint32_t pos;		// or QM_JOURNAL_NONE
+	uint32_t sum;		// of the bytes that follow
+} qmap_jrec_t;
+
+struct qmap_wal {
+	pthread_mutex_t lock;
+	pthread_cond_t wake;	// of the flusher
+	pthread_t flusher;	// if there is an interval
+	int fd, dirty, stop;
+	unsigned hd;		// whose journal it is
+	unsigned interval;	// ms between syncs
+	uint64_t last;		// time of the last one
+	size_t pos;
+	char buf[QM_SNAP_BUF];
+};
 
-	return hd;
+static inline uint64_t
+qmap_ms(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000ull + ts.tv_nsec / 1000000;
 }
 
-unsigned /* API */
-qmap_open(unsigned ktype, unsigned vtype,
-		unsigned mask, unsigned flags)
+static inline uint32_t
+qmap_jsum(qmap_jrec_t *rec, const void *key,
+		const void *value)
 {
-	unsigned hd = _qmap_open(ktype, vtype, mask, flags);
+	uint32_t sum = rec->klen ^ rec->vlen ^ rec->pos;
 
-	if (!(flags & QM_MIRROR))
-		return hd;
+	if (key)
+		sum = XXH32(key, rec->klen, sum);
+	if (value)
+		sum = XXH32(value, rec->vlen, sum);
+	return sum;
+}
 
-	flags &= ~QM_AINDEX;
-	_qmap_open(vtype, ktype, mask, flags | QM_PGET);
-	qmap_assoc(hd + 1, hd, NULL);
+/* Write out what is buffered, and make it durable */
+static int
+qmap_wsync(struct qmap_wal *wal)
+{
+	int ret = qmap_write(wal->fd, wal->buf, wal->pos)
+		|| fdatasync(wal->fd) ? -1 : 0;
 
-	return hd;
+	wal->pos = 0;
+	wal->dirty = 0;
+	wal->last = qmap_ms();
+	return ret;
 }
 
-static size_t
-s_measure(const void *key)
+/* Syncs what writers left buffered once the interval
+ * is up, so that a map that goes idle is not left with
+ * records only in memory. It sleeps until there are
+ * some, and then until their deadline.
+ */
+static void *
+qmap_flusher(void *arg)
 {
-	return strlen(key) + 1;
-}
+	struct qmap_wal *wal = arg;
+	struct timespec ts;
+	uint64_t due;
+
+	pthread_mutex_lock(&wal->lock);
+	while (!wal->stop) {
+		if (!wal->dirty) {
+			pthread_cond_wait(&wal->wake, &wal->lock);
+			continue;
+		}
 
-__attribute__((destructor))
-static void qmap_destruct(void) {
-	for (unsigned i = 0; i < idm.last; i++)
-		qmap_close(i);
+		due = wal->last + wal->interval;
+		if (qmap_ms() < due) {
+			ts.tv_sec = due / 1000;
+			ts.tv_nsec = (due % 1000) * 1000000;
+			pthread_cond_timedwait(&wal->wake,
+					&wal->lock, &ts);
+			continue;
+		}
 
-	idm_drop(&cursor_idm);
-	idm_drop(&idm);
+		if (qmap_wsync(wal))
+			WARN("Journal write error\n");
+	}
+	pthread_mutex_unlock(&wal->lock);
+
+	return NULL;
 }
 
-__attribute__((constructor))
+/* Add a record to the journal of a primary, if it has
+ * one: a put, a delete (no value) or a drop (no key).
+ * Records only get written when the buffer fills, or
+ * when the interval is up. So every thread that wrote
+ * in between shares the same fsync. Puts to QM_AINDEX
+ * maps also have the position n they are at.
+ */
 static void
-qmap_init(void)
+qmap_log_at(qmap_t *qmap, unsigned n, const void *key,
+		size_t klen, const void *value, size_t vlen)
 {
-	qmap_type_t *type;
-	idm = idm_init();
-	cursor_idm = idm_init();
+	struct qmap_wal *wal = qmap->wal;
+	qmap_jrec_t rec;
+	int ret;
 
-	// QM_PTR
-	type = &qmap_types[qmap_reg(sizeof(void *))];
+	if (!wal)
+		return;
 
-	// QM_HNDL
-	type = &qmap_types[qmap_reg(sizeof(unsigned))];
-	type->hash = qmap_nohash;
+	rec.klen = key ? klen : QM_JOURNAL_NONE;
+	rec.vlen = value ? vlen : QM_JOURNAL_NONE;
+	rec.pos = value && (qmap->flags & QM_AINDEX)
+		? n : QM_JOURNAL_NONE;
+
+	rec.sum = qmap_jsum(&rec, key, value);
+
+	pthread_mutex_lock(&wal->lock);
+	ret = qmap_wbuf(wal->fd, wal->buf, &wal->pos,
+			&rec, sizeof(rec))
+		|| (key && qmap_wbuf(wal->fd, wal->buf, &wal->pos,
+					key, rec.klen))
+		|| (value && qmap_wbuf(wal->fd, wal->buf,
+					&wal->pos, value, rec.vlen));
+
+	if (!ret && qmap_ms() - wal->last >= wal->interval)
+		ret = qmap_wsync(wal);
+	else if (!ret && !wal->dirty) {
+		wal->dirty = 1;
+		pthread_cond_signal(&wal->wake);
+	}
+	pthread_mutex_unlock(&wal->lock);
 
-	// QM_STR
-	qmap_mreg(s_measure);
+	if (ret)
+		WARN("Journal write error\n");
 }
 
-/* }}} */
+/* qmap_log, for when we don't know the position */
+static void
+qmap_log(qmap_t *qmap, const void *key, size_t klen,
+		const void *value, size_t vlen)
+{
+	unsigned hd, n = QM_MISS;
 
-/* PUT {{{ */
+	if (qmap->wal && value && (qmap->flags & QM_AINDEX)) {
+		hd = qmap->wal->hd;
+		n = qmap_lookup(hd, key, klen,
+				qmap_hashl(hd, key, klen));
+	}
 
-/* This is the low-level put. It doesn't aim to provide
- * MIRROR functionality in itself, just putting in whatever
- * kind of map.
+	qmap_log_at(qmap, n, key, klen, value, vlen);
+}
+
+/* Apply the records of a journal to a map. A record
+ * that is cut short or doesn't match its sum ends it:
+ * that is where a crash stopped a write.
  */
-static inline unsigned
-_qmap_put(unsigned hd, const void * key,
-		const void *value, unsigned pn)
+static size_t
+qmap_replay(unsigned hd, const char *buf, size_t len)
 {
-	qmap_t *qmap = &qmaps[hd];
-	unsigned n;
-	unsigned id;
-	const void *aval = value;
-	void *rval, *rkey;
-	size_t klen;
+	size_t pos = sizeof(qmap_jhdr_t), klen, vlen;
+	qmap_jrec_t rec;
+	unsigned pn;
 
-	if (key) {
-		unsigned old_n;
+	while (pos + sizeof(rec) <= len) {
+		const char *key, *value;
 
-		id = qmap_id(hd, key);
-		old_n = qmap->map[id];
+		memcpy(&rec, buf + pos, sizeof(rec));
+		klen = rec.klen == QM_JOURNAL_NONE ? 0 : rec.klen;
+		vlen = rec.vlen == QM_JOURNAL_NONE ? 0 : rec.vlen;
+		if (len - pos - sizeof(rec) < klen + vlen)
+			break;
 
-		if (old_n == QM_MISS) {
-			n = idm_new(&qmap->idm);
-			if (pn != QM_MISS)
-				n = pn;
-		} else
-			n = old_n;
-	} else {
-		id = n = idm_new(&qmap->idm);
-		key = &id;
-	}
+		key = buf + pos + sizeof(rec);
+		value = key + klen;
+		if (qmap_jsum(&rec, klen ? key : NULL,
+					vlen ? value : NULL) != rec.sum)
+			break;
 
-	CBUG(n >= qmap->m, "Capacity reached\n");
-	DEBUG(2, "%u %u %u %p\n", hd, n, id, key);
-	rkey = key ? (void *) key : &qmap->map[id];
+		if (rec.klen == QM_JOURNAL_NONE)
+			qmap_drop(hd);
+		else if (rec.vlen == QM_JOURNAL_NONE) {
+			if (!qmap_rec_ok(hd, key, klen,
+						NULL, 0, QM_MISS))
+				break;
 
-	if (qmap->phd == hd) {
-		if (qmap->types[QM_VALUE] == QM_PTR)
-			value = &value;
+			qmap_dell(hd, key, klen);
+		} else {
+			pn = rec.pos == QM_JOURNAL_NONE
+				? QM_MISS : rec.pos;
 
-		if (qmap->map[id] == n) {
-			const void *ekey = qmap_key(hd, n);
-			const void *eval = qmap_val(hd, n);
+			while (pn != QM_MISS && pn >= qmap_at(hd)->m
+					&& (qmap_at(hd)->flags & QM_GROW))
+				qmap_grow(hd);
 
-			free((void *) ekey);
-			free((void *) eval);
-		}
+			if (!qmap_rec_ok(hd, key, klen,
+						value, vlen, pn))
+				break;
 
-		klen = qmap_len(qmap->types[QM_VALUE], aval);
-		rval = malloc(klen);
-		* VAL_ADDR(qmap, n) = rval;
-		memcpy(rval, value, klen);
+			_qmap_putl(hd, key, klen, value, vlen, pn);
+		}
 
-		// this could be avoided
-		// if the key is the same
-		klen = qmap_len(qmap->types[QM_KEY], key);
-		rkey = malloc(klen);
-		memcpy(rkey, key, klen);
+		pos += sizeof(rec) + klen + vlen;
 	}
 
-	qmap->map[id] = n;
-	qmap->omap[n] = rkey;
+	return pos;
+}
 
-	return id;
+int /* API */
+qmap_journal(unsigned hd, int fd, unsigned interval)
+{
+	qmap_t *qmap = qmap_at(hd);
+	pthread_condattr_t cattr;
+	struct qmap_wal *wal;
+	qmap_jhdr_t hdr;
+	size_t len, end;
+	char *buf;
+
+	CBUG(qmap->phd != hd, "Journal the primary instead\n");
+	CBUG(qmap->wal, "Already has a journal\n");
+	CBUG(qmap->flags & QM_BORROW,
+			"Can't journal QM_BORROW maps\n");
+	CBUG(qmap->types[QM_KEY] == QM_PTR
+			|| qmap->types[QM_VALUE] == QM_PTR
+			|| qmap->types[QM_KEY] == QM_ISTR
+			|| qmap->types[QM_VALUE] == QM_ISTR,
+			"Can't journal pointers\n");
+
+	memset(&hdr, 0, sizeof(hdr));
+	memcpy(hdr.magic, QM_JOURNAL_MAGIC, sizeof(hdr.magic));
+	hdr.version = QM_JOURNAL_VERSION;
+	hdr.types[QM_KEY] = qmap->types[QM_KEY];
+	hdr.types[QM_VALUE] = qmap->types[QM_VALUE];
+	hdr.lens[QM_KEY] = qmap_types[hdr.types[QM_KEY]].len;
+	hdr.lens[QM_VALUE] = qmap_types[hdr.types[QM_VALUE]].len;
+
+	if (lseek(fd, 0, SEEK_SET))
+		return -1;
+
+	buf = qmap_slurp(fd, &len);
+	if (!buf)
+		return -1;
+
+	if (!len)
+		end = qmap_write(fd, &hdr, sizeof(hdr))
+			? 0 : sizeof(hdr);
+	else if (len >= sizeof(hdr)
+			&& !memcmp(buf, &hdr, sizeof(hdr)))
+		end = qmap_replay(hd, buf, len);
+	else {
+		WARN("Not a journal of this map\n");
+		end = 0;
+	}
+
+	free(buf);
+
+	// appends go after the last good record
+	if (!end || ftruncate(fd, end)
+			|| lseek(fd, end, SEEK_SET) != (off_t) end)
+		return -1;
+
+	wal = malloc(sizeof(struct qmap_wal));
+	CBUG(!wal, "malloc error\n");
+	pthread_mutex_init(&wal->lock, NULL);
+	// deadlines are in qmap_ms time
+	pthread_condattr_init(&cattr);
+	pthread_condattr_setclock(&cattr, CLOCK_MONOTONIC);
+	pthread_cond_init(&wal->wake, &cattr);
+	pthread_condattr_destroy(&cattr);
+	wal->fd = fd;
+	wal->hd = hd;
+	wal->dirty = wal->stop = 0;
+	wal->interval = interval;
+	wal->last = qmap_ms();
+	wal->pos = 0;
+
+	if (interval)
+		CBUG(pthread_create(&wal->flusher, NULL,
+					qmap_flusher, wal),
+				"pthread_create error\n");
+
+	qmap->wal = wal;
+	return 0;
 }
 
-unsigned /* API */
-qmap_put(unsigned hd, const void * const key,
-		const void * const value)
+int /* API */
+qmap_sync(unsigned hd)
 {
-	unsigned ahd, n, id;
-	idsi_t *cur;
-	const void *rkey, *rval;
+	struct qmap_wal *wal = qmap_at(hd)->wal;
+	int ret;
+
+	if (!wal)
+		return 0;
 
-	id = _qmap_put(hd, key, value, QM_MISS);
-	n = qmaps[hd].map[id];
+	pthread_mutex_lock(&wal->lock);
+	ret = qmap_wsync(wal);
+	pthread_mutex_unlock(&wal->lock);
+	return ret;
+}
 
-	cur = ids_iter(&qmaps[hd].linked);
-	rkey = qmap_key(hd, n);
-	rval = qmap_val(hd, n);
+int /* API */
+qmap_checkpoint(unsigned hd, int fd)
+{
+	qmap_t *qmap = qmap_at(hd);
+	struct qmap_wal *wal = qmap->wal;
+	unsigned i;
+	int ret;
+
+	CBUG(!wal, "No journal\n");
+
+	// writers log with their shard locked, so take all
+	// of those first, and save without taking them again
+	if (qmap->shards)
+		for (i = 0; i < QM_SHARDS; i++)
+			pthread_mutex_lock(&qmap->shards[i].lock);
+
+	// the journal stays whole until the snapshot is
+	pthread_mutex_lock(&wal->lock);
+	ret = qmap_wsync(wal) || _qmap_save(hd, fd,
+			qmap->shards ? QM_CUR_HELD : 0) || fsync(fd)
+		|| ftruncate(wal->fd, sizeof(qmap_jhdr_t))
+		|| lseek(wal->fd, sizeof(qmap_jhdr_t), SEEK_SET)
+		!= sizeof(qmap_jhdr_t)
+		|| fdatasync(wal->fd) ? -1 : 0;
+	wal->last = qmap_ms();
+	pthread_mutex_unlock(&wal->lock);
+
+	if (qmap->shards)
+		for (i = QM_SHARDS; i-- > 0;)
+			pthread_mutex_unlock(&qmap->shards[i].lock);
+
+	return ret;
+}
 
-	while (ids_next(&ahd, &cur)) {
-		qmap_t *aqmap;
-		const void *skey;
+/* Sync and forget the journal, before closing */
+static void
+qmap_wal_close(qmap_t *qmap)
+{
+	struct qmap_wal *wal = qmap->wal;
 
-		aqmap = &qmaps[ahd];
-		aqmap->assoc(&skey, rkey, rval);
+	if (!wal)
+		return;
 
-		_qmap_put(ahd, skey, rval, n);
+	if (wal->interval) {
+		pthread_mutex_lock(&wal->lock);
+		wal->stop = 1;
+		pthread_cond_signal(&wal->wake);
+		pthread_mutex_unlock(&wal->lock);
+		pthread_join(wal->flusher, NULL);
 	}
 
-	return id;
+	if (qmap_wsync(wal))
+		WARN("Journal write error\n");
+
+	pthread_cond_destroy(&wal->wake);
+	pthread_mutex_destroy(&wal->lock);
+	free(wal);
+	qmap->wal = NULL;
 }
 
 /* }}} */
 
-/* GET {{{ */
-
-static int qmap_lnext(unsigned *sn, unsigned cur_id);
+/* DROP + CLOSE + OTHERS {{{ */
 
-const void * /* API */
-qmap_get(unsigned hd, const void * const key)
+/* Forget all entries of a map and its secondaries at
+ * once, without looking at them. For when their storage
+ * is released in bulk.
+ */
+static void
+qmap_clear(unsigned hd)
 {
-	unsigned cur_id = qmap_iter(hd, key, 0), sn;
+	qmap_t *qmap = qmap_at(hd);
+	idsi_t *cur = ids_iter(&qmap->linked);
+	unsigned ahd;
 
-	if (!qmap_lnext(&sn, cur_id))
-		return NULL;
+	while (ids_next(&ahd, &cur))
+		qmap_clear(ahd);
 
-	qmap_fin(cur_id);
+	qmap_idx_free(&qmap->gmap);
+	qmap_idx_free(&qmap->map);
+	qmap_idx_init(&qmap->map, qmap->m);
+	memset(qmap->omap, 0, sizeof(void *) * qmap->m);
+	if (qmap->phd == hd)
+		memset(qmap->table, 0, sizeof(void *) * qmap->m);
+	idm_drop(&qmap->idm);
+	qmap->idm = idm_init();
+	qmap->count = 0;
 
-	return qmap_val(hd, sn);
+	if (qmap->bt)
+		qmap_bt_free(qmap->bt);
+	qmap->bt = NULL;
 }
 
-/* }}} */
-
-/* DELETE {{{ */
-
-static inline unsigned
-qmap_root(unsigned hd)
+void /* API */
+qmap_drop(unsigned hd)
 {
-	while(qmaps[hd].phd != hd)
-		hd = qmaps[hd].phd;
+	qmap_t *qmap = qmap_at(hd), *wqmap;
+	qmap_cur_t cursor;
+	unsigned sn, i;
 
-	return hd;
-}
+	// a secondary's entries are deleted one by one (below)
+	if (qmap->phd == hd)
+		qmap_log(qmap, NULL, 0, NULL, 0);
 
-static void qmap_ndel_topdown(unsigned hd, unsigned n){
-	qmap_t *qmap = &qmaps[hd];
-	const void *key, *value;
-	unsigned id, ahd;
-	idsi_t *cur;
+	if (qmap->shards) {
+		for (i = 0; i < QM_SHARDS; i++) {
+			qmap_shard_t *shard = &qmap->shards[i];
 
-	if (n >= qmap->m)
+			pthread_mutex_lock(&shard->lock);
+			qmap_drop(shard->hd);
+			pthread_mutex_unlock(&shard->lock);
+		}
 		return;
+	}
 
-	cur = ids_iter(&qmap->linked);
-
-	while (ids_next(&ahd, &cur))
-		qmap_ndel_topdown(ahd, n);
+	wqmap = qmap_wbegin(hd);
 
-	key = qmap_key(hd, n);
+	// readers might still use what's in the arena, and
+	// interned strings aren't in it: they need unintern
+	if (qmap->arena && qmap->phd == hd && !wqmap
+			&& qmap->types[QM_KEY] != QM_ISTR
+			&& qmap->types[QM_VALUE] != QM_ISTR)
+	{
+		qmap_clear(hd);
+		qmap_arena_drop(qmap->arena);
+		return;
+	}
 
-	id = qmap_id(hd, key);
+	qmap_iter_init(&cursor, hd, NULL, 0);
 
-	if (qmap->phd == hd) {
-		value = qmap_val(hd, n);
-		free((void *) key);
-		free((void *) value);
+	while (qmap_lnext(&sn, &cursor, hd)) {
+		if (qmap->phd != hd)
+			qmap_log_ndel(hd, sn);
+		qmap_ndel(hd, sn);
 	}
 
-	qmap->map[id] = QM_MISS;
-	qmap->omap[n] = NULL;
-	idm_del(&qmap->idm, n);
-
-}
+	qmap_cur_end(&cursor);
 
-/* Delete based on position */
-static inline void
-qmap_ndel(unsigned hd, unsigned n) {
-	qmap_ndel_topdown(qmap_root(hd), n);
+	qmap_wend(wqmap);
 }
 
-void /* API */
-qmap_del(unsigned hd, const void * const key)
+/* Add what a map without shards has to stats. Sums are
+ * kept in probe_mean until the end.
+ */
+static void
+qmap_stats_add(unsigned hd, qmap_stats_t *stats)
 {
-	unsigned cur = qmap_iter(hd, key, 0), sn;
+	qmap_t *qmap = qmap_at(hd);
+	qmap_idx_t *idxs[] = { &qmap->map, &qmap->gmap };
+	unsigned i, id, d, n;
 
-	while (qmap_lnext(&sn, cur))
-		qmap_ndel(hd, sn);
-}
+	stats->count += qmap->count;
+	stats->capacity += qmap->m;
+	stats->free_ids += qmap->idm.free.n;
 
-/* }}} */
+	for (i = 0; i < 2; i++) {
+		qmap_idx_t *idx = idxs[i];
 
-/* ITERATION {{{ */
+		if (!idx->slots)
+			continue;
 
-void /* API */
-qmap_fin(unsigned cur_id)
-{
-	qmap_cur_t *cursor = &qmap_cursors[cur_id];
+		for (id = 0; id <= idx->mask; id++) {
+			if (idx->slots[id].n == QM_MISS)
+				continue;
 
-	if (cursor->sub_cur)
-		qmap_fin(cursor->sub_cur);
+			d = qmap_slot_dist(idx, id) + 1;
+			stats->probe_mean += d;
+			if (d > stats->probe_max)
+				stats->probe_max = d;
+		}
+	}
 
-	idm_del(&cursor_idm, cur_id);
+	// borrowed ones are someone else's
+	if (qmap->phd != hd || (qmap->flags & QM_BORROW))
+		return;
+
+	for (n = 0; n < qmap->m; n++) {
+		if (!qmap->omap[n])
+			continue;
+
+		stats->key_bytes += qmap_nlen(qmap, QM_KEY, n,
+				qmap_key(hd, n));
+		stats->value_bytes += qmap_nlen(qmap, QM_VALUE, n,
+				qmap_val(hd, n));
+	}
 }
 
-unsigned /* API */
-qmap_iter(unsigned hd, const void * const key, unsigned flags)
+void /* API */
+qmap_stats(unsigned hd, qmap_stats_t *stats)
 {
-	qmap_t *qmap = &qmaps[hd];
-	unsigned cur_id = idm_new(&cursor_idm);
-	qmap_cur_t *cursor = &qmap_cursors[cur_id];
-	unsigned id;
-
-	if (key && !(flags & QM_RANGE)) {
-		unsigned n;
+	qmap_t *qmap = qmap_at(hd), *root;
+	unsigned i;
 
-		id = qmap_id(hd, key);
+	memset(stats, 0, sizeof(*stats));
 
-		CBUG(id >= qmap->m, "Strange. Id hash "
-				"does not fit\n");
+	if (qmap->shards)
+		for (i = 0; i < QM_SHARDS; i++) {
+			qmap_shard_t *shard = &qmap->shards[i];
 
-		n = qmap->map[id];
-		DEBUG(2, "%u %u %u %p\n", hd, n, id, key);
-		cursor->pos = n;
-	} else {
-		cursor->pos = 0;
+			pthread_mutex_lock(&shard->lock);
+			qmap_stats_add(shard->hd, stats);
+			pthread_mutex_unlock(&shard->lock);
+		}
+	else {
+		// keep writers out, readers don't matter
+		root = qmap_at(qmap_root(hd));
+		if (root->flags & QM_LOCKFREE)
+			pthread_mutex_lock(&root->wlock);
+		qmap_stats_add(hd, stats);
+		if (root->flags & QM_LOCKFREE)
+			pthread_mutex_unlock(&root->wlock);
 	}
 
-	cursor->ipos = cursor->pos;
-	cursor->sub_cur = 0;
-	cursor->hd = hd;
-	cursor->key = key;
-	cursor->flags = flags;
-	return cur_id;
+	stats->load = (double) stats->count / stats->capacity;
+	if (stats->count)
+		stats->probe_mean /= stats->count;
 }
 
-/* low-level next */
-static int
-qmap_lnext(unsigned *sn, unsigned cur_id)
+unsigned /* API */
+qmap_count(unsigned hd)
 {
-	register qmap_cur_t *cursor
-		= &qmap_cursors[cur_id];
-	register qmap_t *qmap = &qmaps[cursor->hd];
-	unsigned n;
-	const void *key;
-cagain:
-	n = cursor->pos;
+	qmap_t *qmap = qmap_at(hd), *root;
+	unsigned i, ret = 0;
 
-	if (n >= qmap->idm.last)
-		goto end;
+	if (qmap->shards) {
+		for (i = 0; i < QM_SHARDS; i++) {
+			qmap_shard_t *shard = &qmap->shards[i];
 
-	key = qmap_key(cursor->hd, n);
-	if (key == NULL) {
-		cursor->pos++;
-		goto cagain;
-	}
+			pthread_mutex_lock(&shard->lock);
+			ret += qmap_at(shard->hd)->count;
+			pthread_mutex_unlock(&shard->lock);
+		}
 
-	if (cursor->flags & QM_RANGE) {
-		qmap_type_t *type
-			= &qmap_types[qmap->types[QM_KEY]];
+		return ret;
+	}
 
-		if (cursor->key && type->cmp(key, cursor->key,
-					type->len) < 0)
-		{
-			cursor->pos++;
-			goto cagain;
-		}
-	} else if (cursor->key && n != cursor->ipos)
-		goto end;
+	root = qmap_at(qmap_root(hd));
+	if (!(root->flags & QM_LOCKFREE))
+		return qmap->count;
 
-	DEBUG(3, "NEXT! cur_id %u key %p\n",
-			cur_id, key);
+	pthread_mutex_lock(&root->wlock);
+	ret = qmap->count;
+	pthread_mutex_unlock(&root->wlock);
+	return ret;
+}
 
-	cursor->pos++;
-	*sn = n;
-	return 1;
-end:
-	idm_del(&cursor_idm, cur_id);
-	*sn = QM_MISS;
-	return 0;
+#ifdef QM_INSTRUMENT
+static void
+qmap_instr_add(qmap_instr_t *instr, qmap_t *qmap)
+{
+	unsigned i, j;
+
+	for (i = 0; i < QM_COUNTERS; i++)
+		instr->counters[i] += __atomic_load_n(
+				&qmap->instr.counters[i],
+				__ATOMIC_RELAXED);
+
+	for (j = 0; j < QM_OPS; j++)
+		for (i = 0; i < QM_HIST; i++)
+			instr->hist[j][i] += __atomic_load_n(
+					&qmap->instr.hist[j][i],
+					__ATOMIC_RELAXED);
 }
+#endif
 
 int /* API */
-qmap_next(const void ** ckey, const void ** cval,
-		unsigned cur_id)
+qmap_instr(unsigned hd UNUSED, qmap_instr_t *instr)
 {
-	register qmap_cur_t *c;
-	unsigned sn;
-	int ret = qmap_lnext(&sn, cur_id);
-
-	if (!ret)
-		return 0;
+	memset(instr, 0, sizeof(*instr));
 
-	c = &qmap_cursors[cur_id];
-	*ckey = qmap_key(c->hd, sn);
-	*cval = qmap_val(c->hd, sn);
-	return 1;
-}
+#ifdef QM_INSTRUMENT
+	qmap_t *qmap = qmap_at(hd);
+	unsigned i;
 
-/* }}} */
+	qmap_instr_add(instr, qmap);
+	if (qmap->shards)
+		for (i = 0; i < QM_SHARDS; i++)
+			qmap_instr_add(instr,
+					qmap_at(qmap->shards[i].hd));
 
-/* DROP + CLOSE + OTHERS {{{ */
+	return 0;
+#else
+	return -1;
+#endif
+}
 
 void /* API */
-qmap_drop(unsigned hd)
+qmap_instr_reset(unsigned hd UNUSED)
 {
-	unsigned cur_id = qmap_iter(hd, NULL, 0), sn;
-
-	while (qmap_lnext(&sn, cur_id))
-		qmap_ndel(hd, sn);
+#ifdef QM_INSTRUMENT
+	qmap_t *qmap = qmap_at(hd);
+	unsigned i;
+
+	memset(&qmap->instr, 0, sizeof(qmap->instr));
+	if (qmap->shards)
+		for (i = 0; i < QM_SHARDS; i++)
+			memset(&qmap_at(qmap->shards[i].hd)->instr, 0,
+					sizeof(qmap_instr_t));
+#endif
 }
 
 void /* API */
 qmap_close(unsigned hd)
 {
-	qmap_t *qmap = &qmaps[hd];
+	qmap_t *qmap = qmap_at(hd);
 	idsi_t *cur;
-	unsigned ahd;
+	unsigned ahd, i;
 
 	if (!qmap->omap)
 		return;
 
-	qmap_drop(hd);
+	if (qmap->shards) {
+		for (i = 0; i < QM_SHARDS; i++) {
+			qmap_close(qmap->shards[i].hd);
+			pthread_mutex_destroy(&qmap->shards[i].lock);
+		}
+		free(qmap->shards);
+		qmap->shards = NULL;
+	}
+
+	qmap_wal_close(qmap);
+
+	// entries of file maps stay in the file
+	if (!qmap->base)
+		qmap_drop(hd);
 
 	cur = ids_iter(&qmap->linked);
 	while (ids_next(&ahd, &cur))
 		qmap_close(ahd);
 
 	ids_drop(&qmap->linked);
+	if (qmap->base)
+		qmap_fsave(qmap);
 	idm_drop(&qmap->idm);
 	qmap->idm.last = 0;
-	free(qmap->map);
-	free(qmap->omap);
-	if (qmap->phd == hd)
-		free(qmap->table);
+	qmap->count = 0;
+
+	if (qmap->base) {
+		// the arrays are in the file
+		munmap(qmap->base, QM_FILE_MAX);
+		close(qmap->fd);
+		qmap->base = NULL;
+		qmap->fhdr = NULL;
+	} else {
+		qmap_idx_free(&qmap->map);
+		qmap_idx_free(&qmap->gmap);
+		free(qmap->omap);
+		free(qmap->ohash);
+		free(qmap->lens[QM_KEY]);
+		free(qmap->lens[QM_VALUE]);
+		if (qmap->phd == hd)
+			free(qmap->table);
+	}
+
+	// no one should be reading by now
+	qmap_reclaim(qmap, ULONG_MAX);
+	free(qmap->retired);
+	if (qmap->bt)
+		qmap_bt_free(qmap->bt);
+	qmap->bt = NULL;
+	if (qmap->flags & QM_LOCKFREE)
+		pthread_mutex_destroy(&qmap->wlock);
+
+	// qmap_drop might have taken entries out one by one
+	if (qmap->arena)
+		qmap_arena_drop(qmap->arena);
+	free(qmap->arena);
+	qmap->arena = NULL;
 	qmap->omap = NULL;
+	pthread_mutex_lock(&qmap_lock);
 	idm_del(&idm, hd);
+	pthread_mutex_unlock(&qmap_lock);
 }
 
 void /* API */
 qmap_assoc(unsigned hd, unsigned link, qmap_assoc_t cb)
 {
-	qmap_t *qmap = &qmaps[hd];
+	qmap_t *qmap = qmap_at(hd);
+	qmap_t *lqmap = qmap_at(link);
+
+	CBUG(qmap->shards || lqmap->shards,
+			"Can't associate QM_CONCURRENT maps\n");
 
 	if (!cb)
 		cb = qmap_rassoc;
 
-	ids_push(&qmaps[link].linked, hd);
+	// their keys may point into the table
+	CBUG((lqmap->flags & (QM_COUNTER | QM_GROW))
+			== (QM_COUNTER | QM_GROW),
+			"QM_COUNTER maps with secondaries "
+			"can't have QM_GROW\n");
+
+	ids_push(&lqmap->linked, hd);
+
+	// positions come from the primary
+	if (lqmap->flags & QM_GROW)
+		qmap->flags |= QM_GROW;
+
+	// and so do writes, see qmap_wbegin
+	if ((lqmap->flags & QM_LOCKFREE)
+			&& !(qmap->flags & QM_LOCKFREE))
+	{
+		pthread_mutex_init(&qmap->wlock, NULL);
+		qmap->flags |= QM_LOCKFREE;
+	}
+
+	while (qmap->m < lqmap->m)
+		qmap_grow(hd);
 
 	qmap->assoc = cb;
 	qmap->phd = link;
 	free(qmap->table);
+	free(qmap->arena);
+	qmap->arena = NULL;
+
+	// values are the primary's
+	free(qmap->lens[QM_VALUE]);
+	qmap->lens[QM_VALUE] = NULL;
 }
 
 unsigned /* API */
 qmap_reg(size_t len)
 {
-	unsigned id = types_n ++;
-	qmap_type_t *type = &qmap_types[id];
+	unsigned id;
+	qmap_type_t *type;
+
+	pthread_mutex_lock(&qmap_lock);
+	id = types_n ++;
+	pthread_mutex_unlock(&qmap_lock);
+	type = &qmap_types[id];
 
 	memset(type, 0, sizeof(qmap_type_t));
 	type->len = len;
-	type->hash = qmap_chash;
+	type->hash = qmap_hash_xxh3;
 	type->cmp = qmap_ccmp;
 	return id;
 }
@@ -625,15 +4540,32 @@ qmap_cmp_set(unsigned ref, qmap_cmp_t *cmp)
 	type->cmp = cmp;
 }
 
+void /* API */
+qmap_hash_set(unsigned ref, qmap_hash_t *hash)
+{
+	qmap_types[ref].hash = hash;
+}
+
+const qmap_head_t * /* API */
+qmap_head(unsigned hd)
+{
+	return (const qmap_head_t *) qmap_at(hd);
+}
+
 unsigned /* API */
 qmap_mreg(qmap_measure_t *measure)
 {
-	unsigned id = types_n ++;
-	qmap_type_t *type = &qmap_types[id];
+	unsigned id;
+	qmap_type_t *type;
+
+	pthread_mutex_lock(&qmap_lock);
+	id = types_n ++;
+	pthread_mutex_unlock(&qmap_lock);
+	type = &qmap_types[id];
 
 	memset(type, 0, sizeof(qmap_type_t));
 	type->measure = measure;
-	type->hash = qmap_chash;
+	type->hash = qmap_hash_xxh3;
 	type->cmp = qmap_ccmp;
 	type->len = 0;
 	return id;
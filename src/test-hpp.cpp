@@ -0,0 +1,119 @@
+#include "./../include/qmap.hpp"
+
+#include <cstdio>
+
+/* qmap<K,V> against the C API: what get() finds inline
+ * has to be what qmap_get finds, pointer and all.
+ */
+
+static const char *good = "✅";
+static const char *bad = "❌";
+
+static unsigned errors = 0;
+
+struct point {
+	unsigned x;
+	unsigned short y, z;
+};
+
+template <typename K, typename V>
+static unsigned
+agree(const qmap<K, V> &m, const K &key)
+{
+	const V *v = m.get(key);
+
+	return v != (const V *) qmap_get(m.hd(), &key);
+}
+
+static void
+test_plain(void)
+{
+	qmap<unsigned, float> m(0xFFF);
+	unsigned i, key, n = 0, miss = 0;
+
+	// all with the same home, to make long clusters
+	for (i = 0; i < 3000; i++)
+		m.put(i * 4096, i * 0.5f);
+
+	for (i = 0; i < 3000; i++) {
+		const float *v = m.get(i * 4096);
+
+		key = i * 4096;
+		miss += !v || *v != i * 0.5f || agree(m, key);
+	}
+
+	key = 7;
+	miss += !!m.get(key) || agree(m, key);
+
+	for (i = 0; i < 3000; i += 2)
+		m.del(i * 4096);
+
+	for (i = 0; i < 3000; i++) {
+		key = i * 4096;
+		miss += m.contains(key) != (i & 1) || agree(m, key);
+	}
+
+	m.each([&n](unsigned, float) { n++; });
+	miss += m.size() != 1500 || n != 1500;
+
+	printf("plain %u mismatches\n", miss);
+	errors += miss;
+}
+
+static void
+test_struct(void)
+{
+	qmap<point, unsigned> m(0xF, QM_GROW);
+	unsigned i, miss = 0;
+	point p;
+
+	for (i = 0; i < 5000; i++) {
+		p = { i, (unsigned short) (i % 7), 0 };
+		m.put(p, i);
+	}
+
+	for (i = 0; i < 5000; i++) {
+		const unsigned *v;
+
+		p = { i, (unsigned short) (i % 7), 0 };
+		v = m.get(p);
+		miss += !v || *v != i || agree(m, p);
+	}
+
+	p = { 1, 2, 0 };
+	miss += !!m.get(p) || agree(m, p);
+
+	printf("struct %u mismatches\n", miss);
+	errors += miss;
+}
+
+static void
+test_concurrent(void)
+{
+	qmap<unsigned long, unsigned> m(0xFF, QM_CONCURRENT);
+	unsigned long i;
+	unsigned miss = 0;
+
+	for (i = 0; i < 100; i++)
+		m.put(i << 40, i);
+
+	for (i = 0; i < 100; i++) {
+		const unsigned *v = m.get(i << 40);
+
+		miss += !v || *v != i || agree(m, i << 40);
+	}
+
+	printf("concurrent %s\n", miss ? bad : good);
+	errors += miss;
+}
+
+int main(void) {
+	printf("plain\n");
+	test_plain();
+	printf("struct\n");
+	test_struct();
+	printf("concurrent\n");
+	test_concurrent();
+
+	return errors ? 1 : 0;
+}
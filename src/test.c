@@ -1,7 +1,11 @@
 #include "./../include/qmap.h"
+#include "./../include/qidm.h"
 
 #include <stdio.h>
 #include <string.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/stat.h>
 
 #include <qsys.h>
 
@@ -446,6 +450,1467 @@ void test_eleventh(void)
 	qmap_close(hd);
 }
 
+static inline
+void test_twelfth(void)
+{
+	unsigned hd = gen_open(UTOU, QM_MIRROR | QM_GROW),
+		 rhd = hd + 1;
+	unsigned keys[200], values[200], i, bad = 0;
+	const void *value;
+
+	for (i = 0; i < 200; i++) {
+		keys[i] = i * 7;
+		values[i] = i;
+		qmap_put(hd, &keys[i], &values[i]);
+	}
+
+	for (i = 0; i < 200; i += 2)
+		qmap_del(hd, &keys[i]);
+
+	for (i = 0; i < 200; i++) {
+		value = qmap_get(hd, &keys[i]);
+		if (i & 1 ? !value || * (unsigned *) value != i : !!value)
+			bad++;
+		value = qmap_get(rhd, &values[i]);
+		if (i & 1 ? !value || * (unsigned *) value != i * 7 : !!value)
+			bad++;
+	}
+
+	printf("grown %u mismatches\n", bad);
+	errors += bad;
+	gen_get(hd, &keys[199], &values[199]);
+	gen_get(rhd, &values[199], &keys[199]);
+
+	qmap_close(hd);
+}
+
+static inline
+void test_thirteenth(void)
+{
+	unsigned hd = qmap_open(QM_STR, QM_HNDL, 0xF, 0);
+	char keys[12][8];
+	unsigned values[12], live[12] = { 0 }, i, j, bad = 0;
+	const void *value;
+
+	for (i = 0; i < 12; i++) {
+		snprintf(keys[i], sizeof(keys[i]), "k%u", i * 7);
+		values[i] = i;
+	}
+
+	for (j = 0; j < 500; j++) {
+		i = (j * 5) % 12;
+		if (live[i] && j % 3)
+			qmap_del(hd, keys[i]);
+		else
+			qmap_put(hd, keys[i], &values[i]);
+		live[i] = !live[i] || !(j % 3);
+
+		for (i = 0; i < 12; i++) {
+			value = qmap_get(hd, keys[i]);
+			if (live[i] ? !value || * (unsigned *) value != i : !!value)
+				bad++;
+		}
+	}
+
+	printf("churn %u mismatches\n", bad);
+	errors += bad;
+
+	qmap_close(hd);
+}
+
+static inline
+void test_fourteenth(void)
+{
+	unsigned hd = gen_open(STOS, QM_MIRROR | QM_GROW | QM_ARENA),
+		 rhd = hd + 1;
+	static char big[3000];
+	const void *value;
+
+	memset(big, 'x', sizeof(big) - 1);
+
+	gen_put(hd, "hello", "olleh");
+	gen_put(hd, "hi", "ih");
+	gen_put(hd, "hi", "hey");
+	gen_get(rhd, "hey", "hi");
+	gen_del(hd, "hello", "olleh");
+
+	qmap_put(hd, "big", big);
+	value = qmap_get(hd, "big");
+	printf("big %s\n", value && !strcmp(value, big) ? good : bad);
+	errors += !value || strcmp(value, big);
+
+	qmap_drop(hd);
+	gen_del(hd, "hi", "hey");
+	gen_del(rhd, "hey", "hi");
+	gen_put(hd, "ola", "alo");
+	gen_get(rhd, "alo", "ola");
+
+	qmap_close(hd);
+}
+
+static inline
+void test_fifteenth(void)
+{
+	unsigned hd = gen_open(STOU, QM_MIRROR | QM_GROW),
+		 rhd = hd + 1;
+	const void *keys[] = { "hello", "hi", "ola", "hey", "nope" };
+	unsigned values[] = { 3, 9, 5, 7 };
+	const void *pvalues[] = {
+		&values[0], &values[1], &values[2], &values[3]
+	};
+	const void *rkeys[] = {
+		&values[2], &values[0], &values[3], &values[1]
+	};
+	const void *got[5];
+	unsigned i, found;
+
+	qmap_put_many(hd, keys, pvalues, NULL, 4);
+
+	found = qmap_get_many(hd, keys, got, 5);
+	printf("found %u\n", found);
+	for (i = 0; i < 5; i++)
+		if (got[i])
+			iter_print(hd, keys[i], got[i]);
+
+	found = qmap_get_many(rhd, rkeys, got, 4);
+	printf("found %u\n", found);
+	for (i = 0; i < 4; i++)
+		iter_print(rhd, rkeys[i], got[i]);
+
+	qmap_close(hd);
+}
+
+#define CC_THREADS 4
+#define CC_KEYS 256
+
+typedef struct {
+	unsigned hd, t, bad;
+	char keys[CC_KEYS][12];
+	unsigned values[CC_KEYS];
+} cc_arg_t;
+
+static void *
+cc_thread(void *data)
+{
+	cc_arg_t *arg = data;
+	const void *value;
+	unsigned i, j;
+
+	for (i = 0; i < CC_KEYS; i++) {
+		snprintf(arg->keys[i], sizeof(arg->keys[i]),
+				"t%u-%u", arg->t, i);
+		arg->values[i] = arg->t * CC_KEYS + i;
+	}
+
+	for (j = 0; j < 4; j++) {
+		for (i = 0; i < CC_KEYS; i++)
+			qmap_put(arg->hd, arg->keys[i], &arg->values[i]);
+
+		for (i = 0; i < CC_KEYS; i++) {
+			value = qmap_get(arg->hd, arg->keys[i]);
+			if (!value || * (unsigned *) value
+					!= arg->t * CC_KEYS + i)
+				arg->bad++;
+		}
+
+		// leave the odd ones in, the last time
+		for (i = 0; i < CC_KEYS; i += 1 + (j == 3))
+			qmap_del(arg->hd, arg->keys[i]);
+	}
+
+	return NULL;
+}
+
+static inline
+void test_sixteenth(void)
+{
+	unsigned hd = qmap_open(QM_STR, QM_HNDL, 0xF,
+			QM_CONCURRENT | QM_GROW), cur_id;
+	static cc_arg_t args[CC_THREADS];
+	pthread_t threads[CC_THREADS];
+	const void *key, *value;
+	unsigned i, miss = 0, count = 0;
+
+	for (i = 0; i < CC_THREADS; i++) {
+		args[i].hd = hd;
+		args[i].t = i;
+		pthread_create(&threads[i], NULL, cc_thread, &args[i]);
+	}
+
+	for (i = 0; i < CC_THREADS; i++) {
+		pthread_join(threads[i], NULL);
+		miss += args[i].bad;
+	}
+
+	printf("concurrent %u mismatches\n", miss);
+	errors += miss;
+
+	cur_id = qmap_iter(hd, NULL, 0);
+	while (qmap_next(&key, &value, cur_id))
+		if ((* (unsigned *) value) % 2)
+			count++;
+
+	printf("count %u\n", count);
+	errors += count != CC_THREADS * CC_KEYS / 2;
+
+	value = qmap_get(hd, "t2-7");
+	printf("t2-7 %u\n", value ? * (unsigned *) value : 0);
+
+	cur_id = qmap_iter(hd, "t1-3", 0);
+	while (qmap_next(&key, &value, cur_id))
+		printf("ITER '%s' %u\n", (char *) key,
+				* (unsigned *) value);
+
+	qmap_drop(hd);
+	printf("dropped %s\n", qmap_get(hd, "t2-7") ? bad : good);
+	qmap_close(hd);
+}
+
+#define LF_READERS 3
+#define LF_KEYS 64
+
+static unsigned lf_hd, lf_done;
+static char lf_keys[LF_KEYS][8];
+
+static void *
+lf_reader(void *data)
+{
+	unsigned *bad = data, i, cur_id;
+	const void *key, *value;
+
+	while (!__atomic_load_n(&lf_done, __ATOMIC_ACQUIRE)) {
+		qmap_enter();
+		for (i = 0; i < LF_KEYS; i++) {
+			value = qmap_get(lf_hd, lf_keys[i]);
+			if (value && * (unsigned *) value % 1000 != i)
+				(*bad)++;
+		}
+		qmap_leave();
+
+		cur_id = qmap_iter(lf_hd, NULL, 0);
+		while (qmap_next(&key, &value, cur_id))
+			if (strtoul((char *) key + 1, NULL, 10)
+					!= * (unsigned *) value % 1000)
+				(*bad)++;
+	}
+
+	return NULL;
+}
+
+#define LF_MANY 160 // past the reader slots there are
+
+static pthread_barrier_t lf_bar;
+
+static void *
+lf_many_run(void *arg)
+{
+	unsigned *wrong = arg;
+	const char *value;
+
+	qmap_enter();
+	value = qmap_get(lf_hd, "k");
+	pthread_barrier_wait(&lf_bar);
+
+	// the writer replaces it meanwhile
+	pthread_barrier_wait(&lf_bar);
+	if (!value || strcmp(value, "first"))
+		__atomic_fetch_add(wrong, 1, __ATOMIC_RELAXED);
+	qmap_leave();
+
+	return NULL;
+}
+
+/* All of them in qmap_enter at once */
+static void
+lf_many(void)
+{
+	pthread_t threads[LF_MANY];
+	unsigned wrong = 0, i;
+
+	lf_hd = qmap_open(QM_STR, QM_STR, 0xF, QM_LOCKFREE);
+	qmap_put(lf_hd, "k", "first");
+	pthread_barrier_init(&lf_bar, NULL, LF_MANY + 1);
+
+	for (i = 0; i < LF_MANY; i++)
+		pthread_create(&threads[i], NULL, lf_many_run, &wrong);
+
+	pthread_barrier_wait(&lf_bar);
+	for (i = 0; i < 10; i++)
+		qmap_put(lf_hd, "k", i & 1 ? "first" : "second");
+	pthread_barrier_wait(&lf_bar);
+
+	for (i = 0; i < LF_MANY; i++)
+		pthread_join(threads[i], NULL);
+
+	printf("many readers %s\n", wrong ? bad : good);
+	errors += !!wrong;
+	pthread_barrier_destroy(&lf_bar);
+	qmap_close(lf_hd);
+}
+
+static inline
+void test_seventeenth(void)
+{
+	unsigned bad[LF_READERS] = { 0 }, i, r, v, miss = 0;
+	unsigned count = 0, cur_id;
+	pthread_t threads[LF_READERS];
+	const void *key, *value;
+
+	lf_hd = qmap_open(QM_STR, QM_HNDL, 0xF,
+			QM_LOCKFREE | QM_GROW);
+
+	for (i = 0; i < LF_KEYS; i++)
+		snprintf(lf_keys[i], sizeof(lf_keys[i]), "k%u", i);
+
+	for (i = 0; i < LF_READERS; i++)
+		pthread_create(&threads[i], NULL, lf_reader, &bad[i]);
+
+	for (r = 0; r < 200; r++)
+		for (i = 0; i < LF_KEYS; i++) {
+			v = r * 1000 + i;
+			if ((i + r) % 3)
+				qmap_put(lf_hd, lf_keys[i], &v);
+			else
+				qmap_del(lf_hd, lf_keys[i]);
+		}
+
+	__atomic_store_n(&lf_done, 1, __ATOMIC_RELEASE);
+	for (i = 0; i < LF_READERS; i++) {
+		pthread_join(threads[i], NULL);
+		miss += bad[i];
+	}
+
+	printf("lockfree %u mismatches\n", miss);
+	errors += miss;
+
+	cur_id = qmap_iter(lf_hd, NULL, 0);
+	while (qmap_next(&key, &value, cur_id))
+		count++;
+	printf("count %u\n", count);
+
+	value = qmap_get(lf_hd, "k7");
+	printf("k7 %u\n", value ? * (unsigned *) value : 0);
+
+	qmap_close(lf_hd);
+	lf_many();
+}
+
+static inline
+void test_eighteenth(void)
+{
+	unsigned hd = gen_open(STOU, 0), i, pairs = 0;
+	unsigned values[] = { 3, 9, 5 };
+	qmap_cur_t outer, inner;
+	const void *key, *value, *ikey, *ivalue;
+
+	qmap_put(hd, "hello", &values[0]);
+	qmap_put(hd, "hi", &values[1]);
+	qmap_put(hd, "ola", &values[2]);
+
+	// way past what the old pool could hold
+	for (i = 0; i < 3000; i++)
+		qmap_iter(hd, NULL, 0);
+
+	qmap_iter_init(&outer, hd, NULL, 0);
+	while (qmap_cnext(&key, &value, &outer)) {
+		qmap_iter_init(&inner, hd, NULL, 0);
+		while (qmap_cnext(&ikey, &ivalue, &inner))
+			pairs += * (unsigned *) value
+				< * (unsigned *) ivalue;
+	}
+
+	printf("pairs %u\n", pairs);
+
+	qmap_iter_init(&outer, hd, "hi", 0);
+	while (qmap_cnext(&key, &value, &outer))
+		iter_print(hd, key, value);
+
+	qmap_iter_init(&outer, hd, NULL, 0);
+	qmap_cnext(&key, &value, &outer);
+	qmap_cfin(&outer);
+	printf("after fin %d\n", qmap_cnext(&key, &value, &outer));
+
+	qmap_close(hd);
+}
+
+static inline
+void test_nineteenth(void)
+{
+	static unsigned hds[1500];
+	unsigned i, v, miss = 0;
+	const void *value;
+	char key[16];
+
+	// two handles each, so well over a thousand
+	for (i = 0; i < 1500; i++) {
+		hds[i] = qmap_open(QM_STR, QM_HNDL, 0x3, QM_MIRROR);
+		snprintf(key, sizeof(key), "m%u", i);
+		qmap_put(hds[i], key, &i);
+	}
+
+	for (i = 0; i < 1500; i++) {
+		snprintf(key, sizeof(key), "m%u", i);
+		value = qmap_get(hds[i], key);
+		miss += !value || * (unsigned *) value != i;
+		value = qmap_get(hds[i] + 1, &i);
+		miss += !value || strcmp(value, key);
+	}
+
+	for (i = 0; i < 1500; i++)
+		qmap_close(hds[i]);
+
+	v = qmap_open(QM_HNDL, QM_HNDL, 0, 0);
+	printf("maps %u mismatches, reused %s\n", miss,
+			v <= hds[1499] ? good : bad);
+	errors += miss;
+	qmap_close(v);
+}
+
+static inline
+void test_twentieth(void)
+{
+	unsigned hd = qmap_open(QM_STR, QM_HNDL, 0xF,
+			QM_MIRROR | QM_GROW | QM_SORTED),
+		 rhd = hd + 1;
+	static char keys[2000][8];
+	static unsigned values[2000];
+	unsigned char live[2000] = { 0 };
+	unsigned i, j, r = 7, prev, count, miss = 0, shown = 0;
+	const void *key, *value;
+	qmap_cur_t cur;
+
+	for (i = 0; i < 2000; i++) {
+		snprintf(keys[i], sizeof(keys[i]), "k%04u", i);
+		values[i] = 2000 - i;
+	}
+
+	for (j = 0; j < 20000; j++) {
+		r = r * 1103515245 + 12345;
+		i = (r >> 8) % 2000;
+		if (live[i] && (r & 0x10000))
+			qmap_del(hd, keys[i]);
+		else
+			qmap_put(hd, keys[i], &values[i]);
+		live[i] = !(live[i] && (r & 0x10000));
+	}
+
+	// the ones from k1000 on, in order
+	qmap_iter_init(&cur, hd, "k1000", QM_RANGE);
+	for (i = 1000, count = 0; qmap_cnext(&key, &value, &cur);
+			i++, count++)
+	{
+		while (i < 2000 && !live[i])
+			i++;
+		miss += i >= 2000 || strcmp(key, keys[i]);
+		if (shown++ < 3)
+			printf("ITER '%s' %u\n", (char *) key,
+					* (unsigned *) value);
+	}
+
+	for (i = 1000, j = 0; i < 2000; i++)
+		j += live[i];
+	miss += count != j;
+
+	// values in order, through the secondary
+	qmap_iter_init(&cur, rhd, &values[1500], QM_RANGE);
+	for (prev = 0, count = 0; qmap_cnext(&key, &value, &cur);
+			count++)
+	{
+		miss += * (unsigned *) key <= prev;
+		prev = * (unsigned *) key;
+	}
+
+	for (i = 0, j = 0; i <= 1500; i++)
+		j += live[i];
+	miss += count != j;
+
+	printf("sorted %u mismatches\n", miss);
+	errors += miss;
+
+	qmap_close(hd);
+}
+
+static inline
+void test_twenty_first(void)
+{
+	unsigned hd = qmap_open(QM_STR, QM_HNDL, 0xF,
+			QM_MIRROR | QM_GROW), lhd, i, miss = 0;
+	static unsigned values[300];
+	const void *value;
+	FILE *fp = tmpfile();
+	char key[16];
+
+	for (i = 0; i < 300; i++) {
+		snprintf(key, sizeof(key), "s%u", i);
+		values[i] = i * 3;
+		qmap_put(hd, key, &values[i]);
+	}
+
+	for (i = 0; i < 300; i += 7) {
+		snprintf(key, sizeof(key), "s%u", i);
+		qmap_del(hd, key);
+	}
+
+	printf("save %d\n", qmap_save(hd, fileno(fp)));
+	qmap_close(hd);
+
+	lseek(fileno(fp), 0, SEEK_SET);
+	lhd = qmap_load(fileno(fp));
+
+	for (i = 0; i < 300; i++) {
+		snprintf(key, sizeof(key), "s%u", i);
+		value = qmap_get(lhd, key);
+		if (i % 7)
+			miss += !value || * (unsigned *) value != i * 3;
+		else
+			miss += !!value;
+
+		value = qmap_get(lhd + 1, &values[i]);
+		miss += !(i % 7) != !value
+			|| (value && strcmp(value, key));
+	}
+
+	printf("load %u mismatches\n", miss);
+	errors += miss;
+	qmap_close(lhd);
+
+	fclose(fp);
+
+	fp = tmpfile();
+	fputs("not a snapshot, but long enough to be one", fp);
+	fflush(fp);
+	lseek(fileno(fp), 0, SEEK_SET);
+	printf("bad load %s\n", qmap_load(fileno(fp))
+			== QM_MISS ? good : bad);
+	fclose(fp);
+}
+
+void test_twenty_second(void)
+{
+	char path[] = "/tmp/qmap-test-XXXXXX", key[16];
+	static char big[3000];
+	unsigned hd, i, miss = 0;
+	const void *value;
+	int fd = mkstemp(path);
+
+	close(fd);
+	unlink(path); // so that qmap_fopen creates it
+	memset(big, 'b', sizeof(big) - 1);
+
+	hd = qmap_fopen(path, QM_STR, QM_STR, 0x3FF, 0);
+	for (i = 0; i < 600; i++) {
+		snprintf(key, sizeof(key), "f%u", i);
+		qmap_put(hd, key, i % 50 ? key : big);
+	}
+
+	for (i = 0; i < 600; i += 9) {
+		snprintf(key, sizeof(key), "f%u", i);
+		qmap_del(hd, key);
+	}
+
+	qmap_close(hd);
+
+	hd = qmap_fopen(path, QM_STR, QM_STR, 0, 0);
+	for (i = 0; i < 600; i++) {
+		snprintf(key, sizeof(key), "f%u", i);
+		value = qmap_get(hd, key);
+		if (i % 9)
+			miss += !value || strcmp(value,
+					i % 50 ? key : big);
+		else
+			miss += !!value;
+	}
+
+	// the freed positions are used again
+	qmap_put(hd, "again", "yes");
+	value = qmap_get(hd, "again");
+	miss += !value || strcmp(value, "yes");
+	printf("fopen %u mismatches\n", miss);
+	errors += miss;
+	qmap_close(hd);
+
+	printf("wrong types %s\n", qmap_fopen(path, QM_STR,
+				QM_HNDL, 0, 0) == QM_MISS ? good : bad);
+	unlink(path);
+}
+
+static unsigned
+journal_check(unsigned hd, unsigned from)
+{
+	unsigned i, miss = 0;
+	const void *value;
+	char key[16];
+
+	for (i = 0; i < 200; i++) {
+		snprintf(key, sizeof(key), "j%u", i);
+		value = qmap_get(hd, key);
+		if (from ? i >= from : i % 5 != 0)
+			miss += !value || * (unsigned *) value != i;
+		else
+			miss += !!value;
+	}
+
+	return miss;
+}
+
+void test_twenty_third(void)
+{
+	FILE *jf = tmpfile(), *sf = tmpfile();
+	unsigned hd = qmap_open(QM_STR, QM_HNDL, 0xFF, 0), i,
+		 miss;
+	char key[16];
+
+	printf("journal %d\n", qmap_journal(hd,
+				fileno(jf), 1000));
+
+	for (i = 0; i < 200; i++) {
+		snprintf(key, sizeof(key), "j%u", i);
+		qmap_put(hd, key, &i);
+	}
+
+	for (i = 0; i < 200; i += 5) {
+		snprintf(key, sizeof(key), "j%u", i);
+		qmap_del(hd, key);
+	}
+
+	qmap_close(hd);
+
+	// a crash in the middle of a record
+	fwrite("\x05\0\0\0\x04", 1, 5, jf);
+	fflush(jf);
+
+	hd = qmap_open(QM_STR, QM_HNDL, 0xFF, 0);
+	qmap_journal(hd, fileno(jf), 0);
+	miss = journal_check(hd, 0);
+	printf("replay %u mismatches\n", miss);
+
+	printf("checkpoint %d\n", qmap_checkpoint(hd,
+				fileno(sf)));
+	qmap_drop(hd);
+	for (i = 150; i < 200; i++) {
+		snprintf(key, sizeof(key), "j%u", i);
+		qmap_put(hd, key, &i);
+	}
+	qmap_close(hd);
+
+	lseek(fileno(sf), 0, SEEK_SET);
+	hd = qmap_load(fileno(sf));
+	qmap_journal(hd, fileno(jf), 0);
+	miss += journal_check(hd, 150);
+	printf("snapshot and journal %u mismatches\n", miss);
+	errors += miss;
+	qmap_close(hd);
+
+	hd = qmap_open(QM_HNDL, QM_HNDL, 0, 0);
+	printf("wrong journal %s\n", qmap_journal(hd,
+				fileno(jf), 0) ? good : bad);
+	qmap_close(hd);
+	fclose(jf);
+	fclose(sf);
+}
+
+void test_twenty_fourth(void)
+{
+	unsigned hd = qmap_open(QM_HNDL, QM_HNDL, 0xFF,
+			QM_MIRROR), chd, i;
+	qmap_stats_t st;
+
+	for (i = 0; i < 100; i++)
+		qmap_put(hd, &i, &i);
+
+	for (i = 20; i < 30; i++)
+		qmap_del(hd, &i);
+
+	qmap_stats(hd, &st);
+	printf("count %u/%u capacity %u load %.3f\n",
+			st.count, qmap_count(hd),
+			st.capacity, st.load);
+	printf("bytes %zu %zu free %u\n", st.key_bytes,
+			st.value_bytes, st.free_ids);
+	printf("probes %s\n", st.probe_max >= 1
+			&& st.probe_mean >= 1
+			&& st.probe_mean <= st.probe_max
+			? good : bad);
+
+	qmap_stats(hd + 1, &st);
+	printf("secondary count %u bytes %zu %zu\n", st.count,
+			st.key_bytes, st.value_bytes);
+	qmap_close(hd);
+
+	chd = qmap_open(QM_HNDL, QM_HNDL, 0xFF, QM_CONCURRENT);
+	for (i = 0; i < 100; i++)
+		qmap_put(chd, &i, &i);
+	qmap_stats(chd, &st);
+	printf("concurrent count %u/%u capacity %u\n",
+			st.count, qmap_count(chd), st.capacity);
+	qmap_close(chd);
+}
+
+void test_twenty_fifth(void)
+{
+	unsigned hd = qmap_open(QM_HNDL, QM_HNDL, 0xFF, 0),
+		 ahd = qmap_open(QM_HNDL, QM_HNDL, 0xFF, 0),
+		 i, cur;
+	unsigned long long gets = 0;
+	const void *key, *value;
+	qmap_instr_t in;
+	int ok;
+
+	qmap_assoc(ahd, hd, NULL);
+	for (i = 0; i < 50; i++)
+		qmap_put(hd, &i, &i);
+	for (i = 0; i < 60; i++)
+		qmap_get(hd, &i);
+	qmap_del(hd, &i);
+	i = 3;
+	qmap_del(hd, &i);
+
+	cur = qmap_iter(hd, NULL, 0);
+	while (qmap_next(&key, &value, cur));
+
+	if (qmap_instr(hd, &in)) {
+		// not built with QM_INSTRUMENT
+		ok = !in.counters[QM_C_LOOKUPS];
+	} else {
+		for (i = 0; i < QM_HIST; i++)
+			gets += in.hist[QM_OP_GET][i];
+
+		ok = gets == 60
+			&& in.counters[QM_C_ALLOCS] == 100
+			&& in.counters[QM_C_FREES] == 2
+			&& in.counters[QM_C_CURSORS] == 1
+			&& in.counters[QM_C_LOOKUPS] >= 60
+			&& in.counters[QM_C_GROUPS]
+			>= in.counters[QM_C_LOOKUPS]
+			&& in.counters[QM_C_CMPS] >= 50;
+
+		qmap_instr(ahd, &in);
+		ok = ok && in.counters[QM_C_LINKS] == 51;
+		qmap_instr_reset(hd);
+		qmap_instr(hd, &in);
+		ok = ok && !in.counters[QM_C_LOOKUPS];
+	}
+
+	printf("instr %s\n", ok ? good : bad);
+	qmap_close(hd);
+}
+
+static uint64_t
+same_hash(const void * const key UNUSED, size_t len UNUSED)
+{
+	return 7;
+}
+
+/* Strided keys into a map with keys of this type */
+static unsigned
+hash_probe_max(unsigned ktype, unsigned *miss)
+{
+	unsigned hd = qmap_open(ktype, QM_HNDL, 0x3FF, 0), i, k;
+	const void *value;
+	qmap_stats_t st;
+
+	for (i = 0; i < 300; i++) {
+		k = i * 4096;
+		qmap_put(hd, &k, &i);
+	}
+
+	for (i = 0; i < 300; i++) {
+		k = i * 4096;
+		value = qmap_get(hd, &k);
+		*miss += !value || * (unsigned *) value != i;
+	}
+
+	qmap_stats(hd, &st);
+	qmap_close(hd);
+	return st.probe_max;
+}
+
+void test_twenty_sixth(void)
+{
+	unsigned mix = qmap_reg(sizeof(unsigned)),
+		 crc = qmap_reg(sizeof(unsigned)),
+		 same = qmap_reg(sizeof(unsigned)), miss = 0,
+		 ident_max, mix_max, crc_max;
+
+	qmap_hash_set(mix, qmap_hash_mix);
+	qmap_hash_set(crc, qmap_hash_crc32c);
+	qmap_hash_set(same, same_hash);
+
+	ident_max = hash_probe_max(QM_HNDL, &miss);
+	mix_max = hash_probe_max(mix, &miss);
+	crc_max = hash_probe_max(crc, &miss);
+	hash_probe_max(same, &miss);
+
+	printf("hashes %u mismatches\n", miss);
+	errors += miss;
+	printf("mix spreads %s\n", mix_max * 4 < ident_max
+			&& crc_max * 4 < ident_max ? good : bad);
+	printf("crc32c %s\n", qmap_hash_crc32c("123456789", 9)
+			== 0xE3069283 ? good : bad);
+}
+
+static unsigned measures = 0;
+
+static size_t
+counted_measure(const void *data)
+{
+	measures++;
+	return strlen(data) + 1;
+}
+
+void test_twenty_seventh(void)
+{
+	unsigned blob = qmap_mreg(counted_measure), i, miss = 0;
+	unsigned hd = qmap_open(blob, blob, 0xF,
+			QM_ARENA | QM_GROW);
+	char key[16], value[32];
+	const char *got;
+
+	for (i = 0; i < 200; i++) {
+		size_t klen = snprintf(key, sizeof(key), "k%u", i) + 1;
+		size_t vlen = snprintf(value, sizeof(value),
+				"value of %u", i) + 1;
+
+		qmap_putl(hd, key, klen, value, vlen);
+	}
+
+	for (i = 0; i < 200; i += 2) {
+		size_t klen = snprintf(key, sizeof(key), "k%u", i) + 1;
+
+		qmap_dell(hd, key, klen);
+	}
+
+	for (i = 0; i < 200; i++) {
+		size_t klen = snprintf(key, sizeof(key), "k%u", i) + 1;
+
+		snprintf(value, sizeof(value), "value of %u", i);
+		got = qmap_getl(hd, key, klen);
+		miss += i % 2 ? !got || strcmp(got, value) : !!got;
+	}
+
+
+	printf("lengths %u mismatches, %u measured\n",
+			miss, measures);
+	errors += miss;
+
+	// without lengths: key and value once each,
+	// and only the key when getting or deleting
+	qmap_put(hd, "k0", "zero");
+	qmap_get(hd, "k0");
+	qmap_del(hd, "k0");
+	printf("measured %u\n", measures);
+
+	qmap_close(hd);
+}
+
+void test_twenty_eighth(void)
+{
+	unsigned users = qmap_open(QM_ISTR, QM_HNDL, 0xF, QM_GROW);
+	unsigned owners = qmap_open(QM_ISTR, QM_ISTR, 0xF,
+			QM_GROW | QM_MIRROR);
+	const char *a = qmap_intern("alpha"), *found;
+	unsigned i, miss = 0;
+	char name[16];
+
+	printf("interned once %s\n", a == qmap_intern("alpha")
+			&& a != qmap_intern("beta") ? good : bad);
+
+	for (i = 0; i < 300; i++) {
+		const char *host, *user;
+
+		snprintf(name, sizeof(name), "host-%u", i);
+		host = qmap_intern(name);
+		snprintf(name, sizeof(name), "user-%u", i % 7);
+		user = qmap_intern(name);
+
+		qmap_put(users, user, &i);
+		qmap_put(owners, host, user);
+
+		// the maps hold them now
+		qmap_unintern(host);
+		qmap_unintern(user);
+	}
+
+	for (i = 0; i < 300; i += 2) {
+		snprintf(name, sizeof(name), "host-%u", i);
+		qmap_del(owners, qmap_interned(name));
+	}
+
+	for (i = 0; i < 300; i++) {
+		const char *user;
+
+		snprintf(name, sizeof(name), "host-%u", i);
+		found = qmap_interned(name);
+		if (i % 2 == 0) {
+			miss += !!found;
+			continue;
+		}
+
+		snprintf(name, sizeof(name), "user-%u", i % 7);
+		user = qmap_get(owners, found);
+		miss += !user || user != qmap_interned(name);
+	}
+
+	printf("interned %u mismatches\n", miss);
+	errors += miss;
+
+	// the mirror and users still share them
+	found = qmap_interned("user-3");
+	printf("shared %s\n", found && qmap_get(users, found)
+			&& qmap_get(owners + 1, found) ? good : bad);
+
+	qmap_close(owners);
+	qmap_close(users);
+	qmap_unintern(a);
+	qmap_unintern(a);
+	qmap_unintern(qmap_interned("beta"));
+	printf("released %s\n", !qmap_interned("alpha")
+			&& !qmap_interned("user-3")
+			&& !qmap_interned("host-1") ? good : bad);
+}
+
+void test_twenty_ninth(void)
+{
+	char blob[] = "host\0db1\0port\0" "5432\0user\0admin\0"
+		"host\0db2";
+	unsigned hd = qmap_open(QM_STR, QM_STR, 0xF,
+			QM_BORROW | QM_MIRROR);
+	const char *p = blob, *end = blob + sizeof(blob) - 1;
+	const char *first_host = NULL;
+	qmap_stats_t stats;
+	unsigned ok = 1;
+
+	while (p < end) {
+		const char *key = p, *value = p + strlen(p) + 1;
+
+		if (!first_host)
+			first_host = value;
+
+		qmap_put(hd, key, value);
+		p = value + strlen(value) + 1;
+	}
+
+	// the last put of host wins, and it is the blob's
+	ok &= qmap_get(hd, "host") == blob + 35;
+	ok &= qmap_get(hd, "port") == blob + 14;
+	ok &= !strcmp(qmap_get(hd + 1, "admin"), "user");
+	ok &= !qmap_get(hd + 1, first_host);
+
+	qmap_stats(hd, &stats);
+	ok &= stats.count == 3 && !stats.key_bytes
+		&& !stats.value_bytes;
+
+	qmap_del(hd, "user");
+	ok &= !qmap_get(hd, "user") && !qmap_get(hd + 1, "admin")
+		&& !strcmp(blob + 19, "user");
+
+	printf("borrowed %s\n", ok ? good : bad);
+	errors += !ok;
+	qmap_close(hd);
+}
+
+typedef struct {
+	unsigned hits, bucket;
+} tally_t;
+
+static unsigned tally_assocs = 0;
+
+static void
+tally_bucket(const void **skey, const void * const pkey UNUSED,
+		const void * const value)
+{
+	tally_assocs++;
+	*skey = &((const tally_t *) value)->bucket;
+}
+
+static void
+tally_hit(void *value, int found, void *ctx)
+{
+	tally_t *tally = value;
+
+	tally->hits = found ? tally->hits + 1 : 1;
+	tally->bucket = tally->hits / 4;
+	* (unsigned *) ctx += !found;
+}
+
+void test_thirtieth(void)
+{
+	unsigned tally_type = qmap_reg(sizeof(tally_t));
+	unsigned hd = qmap_open(QM_HNDL, tally_type, 0xF, 0);
+	unsigned buckets = qmap_open(QM_HNDL, QM_HNDL, 0xF, 0);
+	unsigned key = 7, other = 8, zero = 0, two = 2;
+	unsigned created = 0, i, ok = 1;
+	tally_t *first, *tally;
+
+	qmap_assoc(buckets, hd, tally_bucket);
+
+	first = qmap_upsert(hd, &key, tally_hit, &created);
+	for (i = 1; i < 10; i++)
+		tally = qmap_upsert(hd, &key, tally_hit, &created);
+	qmap_upsert(hd, &other, tally_hit, &created);
+
+	// changed where it was, and hits 4 and 8 moved it
+	ok &= tally == first && first->hits == 10 && created == 2;
+	ok &= tally_assocs == 1 + 9 * 2 + 2 + 1;
+	ok &= qmap_get(buckets, &two) == first;
+	ok &= !!qmap_get(buckets, &zero);
+
+	tally = qmap_get_mut(hd, &other);
+	tally->hits = 100;
+	ok &= ((const tally_t *) qmap_get(hd, &other))->hits == 100;
+
+	printf("upserts %s\n", ok ? good : bad);
+	errors += !ok;
+	qmap_close(hd);
+}
+
+#define COUNT_THREADS 4
+#define COUNT_LOOPS 20000
+
+static void *
+count_run(void *arg)
+{
+	unsigned hd = * (unsigned *) arg, i;
+	char word[8];
+
+	for (i = 0; i < COUNT_LOOPS; i++) {
+		snprintf(word, sizeof(word), "w%u", i % 16);
+		if (qmap_head(hd)->flags & QM_LOCKFREE)
+			qmap_incr_atomic(hd, word, 1);
+		else
+			qmap_incr(hd, word, 1);
+	}
+
+	return NULL;
+}
+
+void test_thirty_first(void)
+{
+	unsigned hd = qmap_open(QM_STR, QM_U64, 0xF,
+			QM_COUNTER | QM_GROW);
+	unsigned hds[2], i, j, ok = 1;
+	pthread_t threads[COUNT_THREADS];
+	char word[8];
+
+	for (i = 0; i < 1000; i++) {
+		snprintf(word, sizeof(word), "w%u", i % 100);
+		qmap_incr(hd, word, i % 100 + 1);
+	}
+
+	ok &= qmap_incr(hd, "w41", -2) == 10 * 42 - 2;
+	ok &= * (const uint64_t *) qmap_get(hd, "w99") == 1000;
+	ok &= qmap_count(hd) == 100;
+	qmap_close(hd);
+
+	hds[0] = qmap_open(QM_STR, QM_U64, 0xFF,
+			QM_COUNTER | QM_LOCKFREE);
+	hds[1] = qmap_open(QM_STR, QM_U64, 0xFF,
+			QM_COUNTER | QM_CONCURRENT);
+
+	for (j = 0; j < 2; j++) {
+		for (i = 0; i < COUNT_THREADS; i++)
+			pthread_create(&threads[i], NULL,
+					count_run, &hds[j]);
+		for (i = 0; i < COUNT_THREADS; i++)
+			pthread_join(threads[i], NULL);
+
+		for (i = 0; i < 16; i++) {
+			snprintf(word, sizeof(word), "w%u", i);
+			ok &= * (const uint64_t *) qmap_get(hds[j], word)
+				== COUNT_THREADS * COUNT_LOOPS / 16;
+		}
+
+		qmap_close(hds[j]);
+	}
+
+	printf("counters %s\n", ok ? good : bad);
+	errors += !ok;
+}
+
+#define CKPT_THREADS 4
+#define CKPT_LOOPS 5000
+
+static unsigned ckpt_ids;
+
+static void *
+ckpt_run(void *arg)
+{
+	unsigned hd = * (unsigned *) arg, t, i;
+	char key[16];
+
+	t = __atomic_fetch_add(&ckpt_ids, 1, __ATOMIC_RELAXED);
+	for (i = 0; i < CKPT_LOOPS; i++) {
+		snprintf(key, sizeof(key), "c%u_%u", t, i);
+		qmap_put(hd, key, &i);
+	}
+
+	return NULL;
+}
+
+void test_thirty_second(void)
+{
+	FILE *jf = tmpfile(), *sf = tmpfile();
+	unsigned hd = qmap_open(QM_STR, QM_HNDL, 0xFF,
+			QM_CONCURRENT | QM_GROW), t, i, miss = 0, ret = 0;
+	pthread_t threads[CKPT_THREADS];
+	const unsigned *value;
+	char key[16];
+
+	qmap_journal(hd, fileno(jf), 1000);
+	for (t = 0; t < CKPT_THREADS; t++)
+		pthread_create(&threads[t], NULL, ckpt_run, &hd);
+
+	// while they write
+	for (i = 0; i < 20; i++) {
+		lseek(fileno(sf), 0, SEEK_SET);
+		ret |= ftruncate(fileno(sf), 0);
+		ret |= qmap_checkpoint(hd, fileno(sf));
+	}
+
+	for (t = 0; t < CKPT_THREADS; t++)
+		pthread_join(threads[t], NULL);
+	qmap_close(hd);
+
+	lseek(fileno(sf), 0, SEEK_SET);
+	hd = qmap_load(fileno(sf));
+	qmap_journal(hd, fileno(jf), 0);
+
+	for (t = 0; t < CKPT_THREADS; t++)
+		for (i = 0; i < CKPT_LOOPS; i++) {
+			snprintf(key, sizeof(key), "c%u_%u", t, i);
+			value = qmap_get(hd, key);
+			miss += !value || *value != i;
+		}
+
+	miss += qmap_count(hd) != CKPT_THREADS * CKPT_LOOPS;
+	printf("checkpoints %d, %u mismatches\n", ret, miss);
+	errors += miss;
+	qmap_close(hd);
+	fclose(jf);
+	fclose(sf);
+}
+
+void test_thirty_third(void)
+{
+	FILE *jf = tmpfile(), *sf = tmpfile();
+	unsigned hd = qmap_open(QM_HNDL, QM_HNDL, 0xFF,
+			QM_AINDEX), i, n, cur_id, seen = 0, ok = 1;
+	const unsigned *key, *value;
+
+	for (i = 0; i < 10; i++)
+		qmap_put(hd, NULL, &i);
+
+	// holes
+	n = 3;
+	qmap_del(hd, &n);
+	n = 7;
+	qmap_del(hd, &n);
+
+	ok &= !qmap_save(hd, fileno(sf));
+	qmap_journal(hd, fileno(jf), 0);
+	n = 70;
+	ok &= qmap_put(hd, NULL, &n) == 7;
+	qmap_close(hd);
+
+	lseek(fileno(sf), 0, SEEK_SET);
+	hd = qmap_load(fileno(sf));
+	ok &= qmap_count(hd) == 8;
+	n = 70;
+	ok &= qmap_put(hd, NULL, &n) == 7;
+	qmap_close(hd);
+
+	lseek(fileno(sf), 0, SEEK_SET);
+	hd = qmap_load(fileno(sf));
+	qmap_journal(hd, fileno(jf), 0);
+	n = 30;
+	ok &= qmap_put(hd, NULL, &n) == 3;
+	ok &= qmap_put(hd, NULL, &n) == 10;
+
+	cur_id = qmap_iter(hd, NULL, 0);
+	while (qmap_next((const void **) &key,
+				(const void **) &value, cur_id)) {
+		ok &= *value == (*key == 3 || *key == 7
+				? *key * 10 : *key == 10
+				? 30 : *key);
+		seen++;
+	}
+
+	ok &= seen == 11 && qmap_count(hd) == 11;
+	printf("indices restored %s\n", ok ? good : bad);
+	errors += !ok;
+	qmap_close(hd);
+	fclose(jf);
+	fclose(sf);
+}
+
+void test_thirty_fourth(void)
+{
+	FILE *jf = tmpfile();
+	unsigned hd = qmap_open(QM_HNDL, QM_HNDL, 0xFF, 0), i;
+	struct stat st;
+	off_t start;
+
+	qmap_journal(hd, fileno(jf), 20);
+	fstat(fileno(jf), &st);
+	start = st.st_size;
+
+	for (i = 0; i < 10; i++)
+		qmap_put(hd, &i, &i);
+
+	// nothing else writes, but the interval goes by
+	usleep(200000);
+	fstat(fileno(jf), &st);
+	printf("idle journal synced %s\n", st.st_size > start
+			? good : bad);
+	errors += st.st_size <= start;
+
+	qmap_close(hd);
+	fclose(jf);
+}
+
+void test_thirty_fifth(void)
+{
+	ids_t set = ids_init();
+	unsigned i, id, ok = 1;
+	idsi_t *cur;
+
+	// a few, far apart: scanned, nothing as big as them
+	for (i = 0; i < IDS_SCAN; i++)
+		ids_push(&set, (1u << 16) - i * 1021);
+	ok &= !set.at && set.n == IDS_SCAN;
+	ok &= ids_at(&set, (1u << 16) - 3 * 1021) == 3;
+
+	// then enough of them to index
+	for (i = 0; i < 100; i++)
+		ids_push(&set, i * 7);
+	ok &= !!set.at && set.n == IDS_SCAN + 100;
+
+	for (i = 0; i < 100; i += 2)
+		ids_free(&set, i * 7);
+	for (i = 0; i < 100; i++)
+		ok &= (ids_at(&set, i * 7) != IDM_MISS) == (i & 1);
+	for (i = 0; i < IDS_SCAN; i++)
+		ok &= ids_at(&set, (1u << 16) - i * 1021)
+			!= IDM_MISS;
+
+	// items still have their value, as they used to
+	cur = ids_iter(&set);
+	for (i = 0; ids_next(&id, &cur); i++)
+		ok &= cur[-1].value == id;
+	ok &= i == set.n;
+
+	while (ids_pop(&set) != IDM_MISS)
+		;
+	ok &= !set.n && ids_at(&set, 7) == IDM_MISS;
+
+	printf("sparse ids %s\n", ok ? good : bad);
+	errors += !ok;
+	ids_drop(&set);
+}
+
+void test_thirty_sixth(void)
+{
+	unsigned hd = qmap_open(QM_ISTR, QM_HNDL, 0xFF, QM_ARENA);
+	unsigned i, left = 0;
+	const char *str;
+	char name[16];
+
+	for (i = 0; i < 50; i++) {
+		snprintf(name, sizeof(name), "arena-%u", i);
+		str = qmap_intern(name);
+		qmap_put(hd, str, &i);
+		qmap_unintern(str);
+	}
+
+	qmap_drop(hd);
+	for (i = 0; i < 50; i++) {
+		snprintf(name, sizeof(name), "arena-%u", i);
+		left += !!qmap_interned(name);
+	}
+
+	printf("arena drop released %s\n", left ? bad : good);
+	errors += !!left;
+	qmap_close(hd);
+}
+
+void test_thirty_seventh(void)
+{
+	FILE *jf = tmpfile();
+	unsigned hd = qmap_open(QM_STR, QM_STR, 0xFF, QM_MIRROR);
+	unsigned ok = 1;
+
+	qmap_journal(hd, fileno(jf), 0);
+	qmap_put(hd, "a", "x");
+	qmap_put(hd, "b", "y");
+	qmap_put(hd, "c", "z");
+
+	// through the secondary: by value
+	qmap_del(hd + 1, "x");
+	qmap_close(hd);
+
+	hd = qmap_open(QM_STR, QM_STR, 0xFF, QM_MIRROR);
+	qmap_journal(hd, fileno(jf), 0);
+	ok &= !qmap_get(hd, "a") && !qmap_get(hd + 1, "x");
+	ok &= !!qmap_get(hd, "b") && qmap_count(hd) == 2;
+
+	qmap_drop(hd + 1);
+	qmap_close(hd);
+
+	hd = qmap_open(QM_STR, QM_STR, 0xFF, QM_MIRROR);
+	qmap_journal(hd, fileno(jf), 0);
+	ok &= !qmap_count(hd) && !qmap_get(hd, "c");
+
+	printf("secondary deletes journaled %s\n", ok ? good : bad);
+	errors += !ok;
+	qmap_close(hd);
+	fclose(jf);
+}
+
+void test_thirty_eighth(void)
+{
+	FILE *jf = tmpfile(), *sf = tmpfile();
+	unsigned hd = qmap_open(QM_HNDL, QM_HNDL, 0xF,
+			QM_AINDEX), k, v, a, b, ok = 1;
+	const unsigned *value;
+
+	qmap_journal(hd, fileno(jf), 0);
+	v = 1;
+	a = qmap_put(hd, NULL, &v);
+
+	// an explicit key, way past the capacity
+	k = 1000;
+	v = 2;
+	qmap_put(hd, &k, &v);
+	v = 3;
+	b = qmap_put(hd, NULL, &v);
+
+	ok &= !qmap_save(hd, fileno(sf));
+	qmap_close(hd);
+
+	lseek(fileno(sf), 0, SEEK_SET);
+	hd = qmap_load(fileno(sf));
+	ok &= hd != QM_MISS && qmap_count(hd) == 3;
+	ok &= (value = qmap_get(hd, &k)) && *value == 2;
+	ok &= (value = qmap_get(hd, &a)) && *value == 1;
+	ok &= (value = qmap_get(hd, &b)) && *value == 3;
+	qmap_close(hd);
+
+	hd = qmap_open(QM_HNDL, QM_HNDL, 0xF, QM_AINDEX);
+	qmap_journal(hd, fileno(jf), 0);
+	ok &= qmap_count(hd) == 3;
+	ok &= (value = qmap_get(hd, &k)) && *value == 2;
+	ok &= (value = qmap_get(hd, &b)) && *value == 3;
+
+	printf("explicit indices restored %s\n", ok ? good : bad);
+	errors += !ok;
+	qmap_close(hd);
+	fclose(sf);
+	fclose(jf);
+}
+
+void test_thirty_ninth(void)
+{
+	FILE *jf = tmpfile();
+	unsigned hd = qmap_open(QM_STR, QM_U64, 0xF, QM_COUNTER);
+	const char *keys[] = { "b", "c" };
+	const void *values[] = { NULL, NULL };
+	const uint64_t *count;
+	unsigned ok = 1;
+
+	qmap_journal(hd, fileno(jf), 0);
+	qmap_put(hd, "a", NULL);
+	qmap_put_many(hd, (const void * const *) keys,
+			values, NULL, 2);
+	ok &= (count = qmap_get(hd, "a")) && *count == 0;
+	qmap_incr(hd, "b", 5);
+	qmap_close(hd);
+
+	// a put of NULL is a 0, not a delete
+	hd = qmap_open(QM_STR, QM_U64, 0xF, QM_COUNTER);
+	qmap_journal(hd, fileno(jf), 0);
+	ok &= qmap_count(hd) == 3;
+	ok &= (count = qmap_get(hd, "a")) && *count == 0;
+	ok &= (count = qmap_get(hd, "b")) && *count == 5;
+	ok &= (count = qmap_get(hd, "c")) && *count == 0;
+
+	printf("null counters %s\n", ok ? good : bad);
+	errors += !ok;
+	qmap_close(hd);
+	fclose(jf);
+}
+
+void test_fortieth(void)
+{
+	char path[] = "/tmp/qmap-test-XXXXXX";
+	unsigned hd, hd2, i, n, ok = 1;
+	int fd = mkstemp(path);
+
+	close(fd);
+	unlink(path);
+
+	hd = qmap_fopen(path, QM_HNDL, QM_HNDL, 0xFF, QM_AINDEX);
+	for (i = 0; i < 10; i++)
+		qmap_put(hd, NULL, &i);
+	n = 3;
+	qmap_del(hd, &n);
+	n = 7;
+	qmap_del(hd, &n);
+	qmap_close(hd);
+
+	// count and free ids come from the header
+	hd = qmap_fopen(path, QM_HNDL, QM_HNDL, 0, QM_AINDEX);
+	ok &= qmap_count(hd) == 8;
+
+	// still open, as if it had crashed: positions are read
+	hd2 = qmap_fopen(path, QM_HNDL, QM_HNDL, 0, QM_AINDEX);
+	ok &= qmap_count(hd2) == 8;
+	qmap_close(hd2);
+
+	n = 70;
+	ok &= qmap_put(hd, NULL, &n) == 7;
+	n = 30;
+	ok &= qmap_put(hd, NULL, &n) == 3;
+	ok &= qmap_put(hd, NULL, &n) == 10;
+	qmap_close(hd);
+
+	hd = qmap_fopen(path, QM_HNDL, QM_HNDL, 0, QM_AINDEX);
+	ok &= qmap_count(hd) == 11;
+	ok &= qmap_put(hd, NULL, &n) == 11;
+
+	printf("file ids kept %s\n", ok ? good : bad);
+	errors += !ok;
+	qmap_close(hd);
+	unlink(path);
+}
+
+#define MANY_MAPS 70000 // past the first chunk of handles
+
+void test_forty_first(void)
+{
+	static unsigned hds[MANY_MAPS];
+	unsigned i, n, ok = 1;
+	const unsigned *value;
+
+	for (i = 0; i < MANY_MAPS; i++) {
+		hds[i] = qmap_open(QM_HNDL, QM_HNDL, 0x1, 0);
+		qmap_put(hds[i], &i, &i);
+	}
+
+	// and a pair that may straddle two
+	n = qmap_open(QM_HNDL, QM_HNDL, 0x1, QM_MIRROR);
+	qmap_put(n, &i, &ok);
+	ok &= !!qmap_get(n + 1, &ok);
+	qmap_close(n);
+
+	for (i = 0; i < MANY_MAPS; i++) {
+		ok &= (value = qmap_get(hds[i], &i)) && *value == i;
+		qmap_close(hds[i]);
+	}
+
+	printf("many maps %s\n", ok ? good : bad);
+	errors += !ok;
+}
+
 int main(void) {
 	printf("first\n");
 	test_first();
@@ -471,6 +1936,66 @@ int main(void) {
 	test_tenth();
 	printf("eleventh\n");
 	test_eleventh();
+	printf("twelfth\n");
+	test_twelfth();
+	printf("thirteenth\n");
+	test_thirteenth();
+	printf("fourteenth\n");
+	test_fourteenth();
+	printf("fifteenth\n");
+	test_fifteenth();
+	printf("sixteenth\n");
+	test_sixteenth();
+	printf("seventeenth\n");
+	test_seventeenth();
+	printf("eighteenth\n");
+	test_eighteenth();
+	printf("nineteenth\n");
+	test_nineteenth();
+	printf("twentieth\n");
+	test_twentieth();
+	printf("twenty-first\n");
+	test_twenty_first();
+	printf("twenty-second\n");
+	test_twenty_second();
+	printf("twenty-third\n");
+	test_twenty_third();
+	printf("twenty-fourth\n");
+	test_twenty_fourth();
+	printf("twenty-fifth\n");
+	test_twenty_fifth();
+	printf("twenty-sixth\n");
+	test_twenty_sixth();
+	printf("twenty-seventh\n");
+	test_twenty_seventh();
+	printf("twenty-eighth\n");
+	test_twenty_eighth();
+	printf("twenty-ninth\n");
+	test_twenty_ninth();
+	printf("thirtieth\n");
+	test_thirtieth();
+	printf("thirty-first\n");
+	test_thirty_first();
+	printf("thirty-second\n");
+	test_thirty_second();
+	printf("thirty-third\n");
+	test_thirty_third();
+	printf("thirty-fourth\n");
+	test_thirty_fourth();
+	printf("thirty-fifth\n");
+	test_thirty_fifth();
+	printf("thirty-sixth\n");
+	test_thirty_sixth();
+	printf("thirty-seventh\n");
+	test_thirty_seventh();
+	printf("thirty-eighth\n");
+	test_thirty_eighth();
+	printf("thirty-ninth\n");
+	test_thirty_ninth();
+	printf("fortieth\n");
+	test_fortieth();
+	printf("forty-first\n");
+	test_forty_first();
 
 	return -errors;
 }